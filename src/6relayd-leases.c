@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) 2013 Steven Barth <steven@midlink.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Example reader printing the shared memory lease table of 6relayd
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "leasetable.h"
+
+
+int main(int argc, char* const argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <leasetable>\n", argv[0]);
+        return 1;
+    }
+
+    size_t size;
+    const struct leasetable *table = leasetable_open(argv[1], &size);
+    if (!table) {
+        fprintf(stderr, "Failed to open lease table %s\n", argv[1]);
+        return 2;
+    }
+
+    struct leasetable_entry *entries = malloc(table->capacity * sizeof(*entries));
+    if (!entries)
+        return 3;
+
+    ssize_t count = leasetable_snapshot(table, entries, table->capacity);
+    if (count < 0) {
+        fprintf(stderr, "Failed to read lease table %s (%s)\n", argv[1],
+                strerror(errno));
+        free(entries);
+        leasetable_close(table, size);
+        return 4;
+    }
+
+    for (ssize_t i = 0; i < count; ++i) {
+        const struct leasetable_entry *e = &entries[i];
+        char duidbuf[264];
+        for (size_t j = 0; j < e->clid_len; ++j)
+            sprintf(&duidbuf[2 * j], "%02x", e->clid[j]);
+        duidbuf[e->clid_len * 2] = 0;
+
+        // [netns/]iface DUID iaid hostname lifetime assigned length [addrs...]
+        printf("%.63s%s%.16s %s %x %s %u %x %u", e->netns,
+                (e->netns[0]) ? "/" : "", e->ifname, duidbuf, e->iaid,
+                (e->hostname[0]) ? e->hostname : "-", e->valid_until,
+                e->assigned, (unsigned)e->length);
+
+        for (size_t j = 0; j < e->addr_cnt && j < LEASETABLE_MAX_ADDRS; ++j) {
+            char ipbuf[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, &e->addr[j], ipbuf, sizeof(ipbuf));
+            printf(" %s/%u", ipbuf, (unsigned)e->length);
+        }
+        putchar('\n');
+    }
+
+    free(entries);
+    leasetable_close(table, size);
+    return 0;
+}
@@ -21,19 +21,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/ip6.h>
 #include <netpacket/packet.h>
 #include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 
@@ -42,20 +48,90 @@
 
 static struct relayd_config config;
 
-static int epoll, ioctl_sock;
-static size_t epoll_registered = 0;
-static volatile bool do_stop = false;
+// Single producer single consumer ring between two loops
+struct relayd_queue {
+    struct relayd_event event; // Eventfd waking the consumer
+    uint32_t head; // Advanced by the consumer
+    uint32_t tail; // Advanced by the producer
+    uint32_t dropped;
+    struct relayd_message ring[RELAYD_QUEUE_SIZE];
+};
+
+// Datagrams that found the send buffer full, retried on EPOLLOUT
+struct relayd_outpacket {
+    struct sockaddr_in6 dest;
+    const struct relayd_interface *iface;
+    uint64_t queued_at;
+    size_t len;
+    uint8_t *data;
+};
+
+struct relayd_outqueue {
+    struct relayd_event event; // Duplicate of the socket polled for EPOLLOUT
+    struct relayd_outqueue *next;
+    int socket;
+    size_t head;
+    size_t cnt;
+    bool polling; // Polled for EPOLLOUT, only while datagrams wait
+    struct relayd_outpacket packets[RELAYD_OUTQUEUE_LEN];
+};
+
+static struct {
+    int epoll;
+    size_t registered;
+    struct relayd_outqueue *outqueues;
+    struct relayd_event *ready[RELAYD_PRIO_MAX];
+    struct relayd_event *ready_tail[RELAYD_PRIO_MAX];
+    pthread_t thread;
+    struct relayd_queue *queues[RELAYD_LOOP_MAX]; // Incoming by producer
+} loops[RELAYD_LOOP_MAX];
+
+static __thread enum relayd_loop current_loop = RELAYD_LOOP_MAIN;
+static __thread unsigned current_load = 0;
+
+// Receive statistics per priority class
+static const char *priority_names[RELAYD_PRIO_MAX] = {"high", "normal", "low"};
+static uint64_t rx_dropped[RELAYD_PRIO_MAX];
+static unsigned rx_peak_load[RELAYD_PRIO_MAX];
+
+// Send queue statistics
+static uint64_t tx_queued, tx_retried, tx_stale, tx_superseded, tx_overflow;
+static unsigned tx_peak_depth;
+static bool threads_running = false;
+static const char *stats_path = NULL;
 
-static int rtnl_socket = -1;
-static int rtnl_seq = 0;
+static volatile bool do_stop = false;
+static volatile bool do_dump_stats = false;
+
+// Network namespaces of the interfaces, 0 is the one we started in
+struct relayd_netns {
+    const char *name;
+    int fd;
+    int ioctl_sock;
+    struct relayd_interface **iface_index;
+    int iface_index_len;
+};
+
+static struct relayd_netns *netns = NULL;
+static size_t netns_cnt = 0;
+static __thread size_t current_netns = 0; // Namespace the thread is in
+static __thread size_t receive_netns = 0;
+
+static __thread int *rtnl_socket = NULL; // Per namespace, opened on demand
+static __thread int rtnl_seq = 0;
 static int urandom_fd = -1;
 
 static int print_usage(const char *name);
 static void set_stop(_unused int signal);
+static void set_dump_stats(_unused int signal);
+static void write_stats(const char *statsfile);
 static void wait_child(_unused int signal);
+static ssize_t open_netns(const char *name, size_t len);
 static int open_interface(struct relayd_interface *iface,
-        const char *ifname, bool external);
-static void relayd_receive_packets(struct relayd_event *event);
+        const char *name, bool external);
+static bool relayd_receive_packets(struct relayd_event *event);
+static void run_loop(enum relayd_loop loop);
+static int start_threads(void);
 
 
 int main(int argc, char* const argv[])
@@ -63,10 +139,11 @@ int main(int argc, char* const argv[])
     memset(&config, 0, sizeof(config));
 
     const char *pidfile = "/var/run/6relayd.pid";
+    const char *statsfile = "/var/run/6relayd.stats";
     bool daemonize = false;
     int verbosity = 0;
     int c;
-    while ((c = getopt(argc, argv, "ASR:D:Nsucn::l:a:rt:m:oi:p:dvh")) != -1) {
+    while ((c = getopt(argc, argv, "ASR:D:Nsucn::l:a:f:q:b:T:e:L:rygk:w:t:m:oi:p:x:djB:vh")) != -1) {
         switch (c) {
         case 'A':
             config.enable_router_discovery_relay = true;
@@ -133,10 +210,57 @@ int main(int argc, char* const argv[])
             config.dhcpv6_lease[config.dhcpv6_lease_len - 1] = optarg;
             break;
 
+        case 'f':
+            config.dhcpv6_leasefile = optarg;
+            break;
+
+        case 'q':
+            config.dhcpv6_querysocket = optarg;
+            break;
+
+        case 'b':
+            config.dhcpv6_leasetable = optarg;
+            break;
+
+        case 'T':
+            config.dhcpv6_policy = realloc(config.dhcpv6_policy,
+                    sizeof(char*) * ++config.dhcpv6_policy_len);
+            config.dhcpv6_policy[config.dhcpv6_policy_len - 1] = optarg;
+            break;
+
+        case 'e':
+            config.dhcpv6_server = realloc(config.dhcpv6_server,
+                    sizeof(char*) * ++config.dhcpv6_server_len);
+            config.dhcpv6_server[config.dhcpv6_server_len - 1] = optarg;
+            break;
+
+        case 'L':
+            config.dhcpv6_requestor = realloc(config.dhcpv6_requestor,
+                    sizeof(char*) * ++config.dhcpv6_requestor_len);
+            config.dhcpv6_requestor[config.dhcpv6_requestor_len - 1] = optarg;
+            break;
+
         case 'r':
             config.enable_route_learning = true;
             break;
 
+        case 'y':
+            config.enable_route_learning = true;
+            config.enable_route_aggregation = true;
+            break;
+
+        case 'g':
+            config.enable_ndp_snooping = true;
+            break;
+
+        case 'k':
+            config.ndp_keepalive_rate = atoi(optarg);
+            break;
+
+        case 'w':
+            config.ndp_snapshot = optarg;
+            break;
+
         case 't':
             config.static_ndp = realloc(config.static_ndp,
                     sizeof(char*) * ++config.static_ndp_len);
@@ -162,6 +286,10 @@ int main(int argc, char* const argv[])
             pidfile = optarg;
             break;
 
+        case 'x':
+            statsfile = optarg;
+            break;
+
         case 'd':
             daemonize = true;
             break;
@@ -170,6 +298,17 @@ int main(int argc, char* const argv[])
             verbosity++;
             break;
 
+        case 'j':
+            config.enable_threads = true;
+            break;
+
+        case 'B':
+            if (sscanf(optarg, "%d,%d,%d", &config.rcvbuf[RELAYD_PRIO_HIGH],
+                    &config.rcvbuf[RELAYD_PRIO_NORMAL],
+                    &config.rcvbuf[RELAYD_PRIO_LOW]) < 1)
+                return print_usage(argv[0]);
+            break;
+
         default:
             return print_usage(argv[0]);
         }
@@ -189,32 +328,110 @@ int main(int argc, char* const argv[])
         return 2;
     }
 
-    if ((epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
-        syslog(LOG_ERR, "Unable to open epoll: %s", strerror(errno));
-        return 2;
+    for (size_t i = 0; i < ((config.enable_threads) ? RELAYD_LOOP_MAX : 1); ++i) {
+        if ((loops[i].epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            syslog(LOG_ERR, "Unable to open epoll: %s", strerror(errno));
+            return 2;
+        }
     }
 
-    ioctl_sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    // Interfaces of other namespaces are reached by entering these
+    if (!(netns = calloc(1, sizeof(*netns))))
+        return 2;
 
-    if ((rtnl_socket = relayd_open_rtnl_socket()) < 0) {
+    netns_cnt = 1;
+    netns[0].name = "";
+    netns[0].fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if ((netns[0].ioctl_sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
         syslog(LOG_ERR, "Unable to open socket: %s", strerror(errno));
         return 2;
     }
 
-    if (open_interface(&config.master, argv[optind++], false))
-        return 3;
+    char *masters = argv[optind++];
+    config.mastercount = 1;
+    for (char *c = masters; (c = strchr(c, ',')); ++c)
+        ++config.mastercount;
+    config.masters = calloc(config.mastercount, sizeof(*config.masters));
+
+    // A master of '.' skips relaying and only enables server features
+    char *saveptr = NULL;
+    for (size_t i = 0; i < config.mastercount; ++i) {
+        const char *name = strtok_r((i == 0) ? masters : NULL, ",", &saveptr);
+        if (!name || (strcmp(name, ".") &&
+                open_interface(&config.masters[i], name, false)))
+            return 3;
+    }
 
     config.slavecount = argc - optind;
     config.slaves = calloc(config.slavecount, sizeof(*config.slaves));
 
     for (size_t i = 0; i < config.slavecount; ++i) {
-        const char *name = argv[optind + i];
+        char *name = argv[optind + i];
         bool external = (name[0] == '~');
         if (external)
             ++name;
 
-        if (open_interface(&config.slaves[i], name, external))
+        char *sep = strchr(name, '@');
+        if (sep)
+            *sep++ = 0;
+
+        struct relayd_interface *slave = &config.slaves[i];
+        if (open_interface(slave, name, external))
+            return 3;
+
+        // Slaves follow the first master of their namespace or the first
+        // master at all unless mapped with @<master>
+        for (size_t j = 0; j < config.mastercount && !slave->upstream; ++j)
+            if ((sep) ? (config.masters[j].name &&
+                    !strcmp(config.masters[j].name, sep)) :
+                    (config.masters[j].netns == slave->netns))
+                slave->upstream = &config.masters[j];
+
+        if (!sep && !slave->upstream) {
+            slave->upstream = &config.masters[0];
+        } else if (!slave->upstream) {
+            syslog(LOG_ERR, "Unknown master %s for %s", sep, name);
             return 3;
+        } else if (slave->upstream->name && slave->upstream->netns != slave->netns) {
+            syslog(LOG_ERR, "Master %s of %s is in another namespace", sep, name);
+            return 3;
+        }
+
+        // Shards don't span namespaces, their sockets live in one
+        if (i > 0) {
+            bool split = (i % RELAYD_SHARD_SIZE == 0 ||
+                    slave->netns != slave[-1].netns);
+            slave->shard = slave[-1].shard + split;
+        }
+    }
+
+    // Masters are served by the first shard of their namespace
+    for (size_t i = 0; i < config.mastercount; ++i)
+        for (size_t j = config.slavecount; j > 0; --j)
+            if (config.slaves[j - 1].netns == config.masters[i].netns)
+                config.masters[i].shard = config.slaves[j - 1].shard;
+
+    // Index interfaces for constant time lookups on received packets,
+    // masters take precedence as in relayd_get_interface_by_name
+    for (size_t i = 0; i < config.mastercount + config.slavecount; ++i) {
+        struct relayd_interface *iface = (i < config.slavecount) ?
+                &config.slaves[i] : &config.masters[i - config.slavecount];
+        struct relayd_netns *ns = &netns[iface->netns];
+        if (!iface->name)
+            continue; // Master '.'
+
+        if (iface->ifindex >= ns->iface_index_len) {
+            int len = iface->ifindex + 1;
+            struct relayd_interface **n = realloc(ns->iface_index, len * sizeof(*n));
+            if (!n)
+                return 3;
+
+            memset(&n[ns->iface_index_len], 0,
+                    (len - ns->iface_index_len) * sizeof(*n));
+            ns->iface_index = n;
+            ns->iface_index_len = len;
+        }
+        ns->iface_index[iface->ifindex] = iface;
     }
 
     if ((urandom_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0)
@@ -223,16 +440,35 @@ int main(int argc, char* const argv[])
     struct sigaction sa = {.sa_handler = SIG_IGN};
     sigaction(SIGUSR1, &sa, NULL);
 
+    // Modules register their events with the loop they are initialized on
+    if (config.enable_threads)
+        current_loop = RELAYD_LOOP_RD;
+
     if (init_router_discovery_relay(&config))
         return 4;
 
+    if (config.enable_threads)
+        current_loop = RELAYD_LOOP_DHCPV6;
+
     if (init_dhcpv6_relay(&config))
         return 4;
 
+    if (config.enable_threads)
+        current_loop = RELAYD_LOOP_NDP;
+
     if (init_ndp_proxy(&config))
         return 4;
 
-    if (epoll_registered == 0) {
+    // Threads start out in the namespace of the one creating them
+    current_loop = RELAYD_LOOP_MAIN;
+    if (relayd_enter_netns(0))
+        return 4;
+
+    size_t registered = 0;
+    for (size_t i = 0; i < RELAYD_LOOP_MAX; ++i)
+        registered += loops[i].registered;
+
+    if (registered == 0) {
         syslog(LOG_WARNING, "No relays enabled or no slave "
                 "interfaces specified. stopped.");
         return 5;
@@ -256,22 +492,24 @@ int main(int argc, char* const argv[])
     signal(SIGHUP, set_stop);
     signal(SIGINT, set_stop);
     signal(SIGCHLD, wait_child);
+    signal(SIGUSR2, set_dump_stats);
 
-    // Main loop
-    while (!do_stop) {
-        struct epoll_event ev[16];
-        int len = epoll_wait(epoll, ev, 16, -1);
-        for (int i = 0; i < len; ++i) {
-            struct relayd_event *event = ev[i].data.ptr;
-            if (event->handle_event)
-                event->handle_event(event);
-            else if (event->handle_dgram)
-                relayd_receive_packets(event);
-        }
-    }
+    stats_path = statsfile;
+    if (config.enable_threads && start_threads())
+        return 6;
+
+    run_loop(RELAYD_LOOP_MAIN);
 
     syslog(LOG_WARNING, "Termination requested by signal.");
 
+    if (threads_running) {
+        struct relayd_message wakeup = {.handle = NULL};
+        for (size_t i = RELAYD_LOOP_MAIN + 1; i < RELAYD_LOOP_MAX; ++i) {
+            relayd_post(i, &wakeup);
+            pthread_join(loops[i].thread, NULL);
+        }
+    }
+
     deinit_ndp_proxy();
     deinit_router_discovery_relay();
     free(config.slaves);
@@ -283,8 +521,10 @@ int main(int argc, char* const argv[])
 static int print_usage(const char *name)
 {
     fprintf(stderr,
-    "Usage: %s [options] <master> [[~]<slave1> [[~]<slave2> [...]]]\n"
+    "Usage: %s [options] <master>[,<master2>...] [[~]<slave1>[@<master>] [...]]\n"
     "\nNote: to use server features only (no relaying) set master to '.'\n"
+    "      slaves relay to the first master unless given @<master>\n"
+    "      prefix interfaces as <netns>/<ifname> to serve other namespaces\n"
     "\nFeatures:\n"
     "   -A      Automatic relay (defaults: RrelayDrelayNsr)\n"
     "   -S      Automatic server (defaults: RserverDserver)\n"
@@ -311,13 +551,29 @@ static int print_usage(const char *name)
     "   -n [server] RD/DHCPv6: always rewrite name server\n"
     "   -l <file>,<cmd> DHCPv6: IA lease-file and update callback\n"
     "   -a <duid>:<val> DHCPv6: IA_NA static assignment\n"
+    "   -f <file>   DHCPv6: read <duid>:<val> static assignments from file\n"
+    "   -q <socket> DHCPv6: answer address lookups on unix socket\n"
+    "   -b <file>   DHCPv6: publish leases in shared memory (/dev/shm/...)\n"
+    "   -T [<if>:]<lifetime>[,<renews/s>]\n"
+    "           DHCPv6: lease lifetime (3600) and renew budget\n"
+    "   -e <server> DHCPv6: relay to unicast server (repeatable)\n"
+    "   -L <addr>   DHCPv6: answer leasequeries from <addr> (repeatable)\n"
     "   -r      NDP: learn routes to neighbors\n"
+    "           DHCPv6: learn routes to relayed delegations\n"
+    "   -y      NDP: learn routes, aggregated per /64\n"
+    "   -g      NDP: learn hosts from unsolicited NA and DAD\n"
+    "   -k <n>  NDP: keep stale neighbors alive, <n> probes/s\n"
+    "   -w <file>   NDP: keep neighbors and routes across restarts\n"
     "   -t <p>/<l>:<if> NDP: define a static NDP-prefix on <if>\n"
     "   slave prefix ~  NDP: don't proxy NDP for hosts and only\n"
     "           serve NDP for DAD and traffic to router\n"
     "\nInvocation options:\n"
     "   -p <pidfile>    Set pidfile (/var/run/6relayd.pid)\n"
+    "   -x <statsfile>  Set file written on SIGUSR2 (/var/run/6relayd.stats)\n"
     "   -d      Daemonize\n"
+    "   -j      Run RD, DHCPv6 and NDP on separate threads\n"
+    "   -B <high>[,<normal>[,<low>]]    Receive buffers in bytes of\n"
+    "           NDP/RD, DHCPv6 and netlink sockets\n"
     "   -v      Increase logging verbosity\n"
     "   -h      Show this help\n\n",
     name);
@@ -337,14 +593,145 @@ static void set_stop(_unused int signal)
 }
 
 
-// Create an interface context
-static int open_interface(struct relayd_interface *iface,
-        const char *ifname, bool external)
+static void set_dump_stats(_unused int signal)
+{
+    do_dump_stats = true;
+}
+
+
+// Replace the old statistics file atomically
+static void finish_stats(struct relayd_message *msg)
+{
+    char tmpfile[PATH_MAX];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", stats_path);
+
+    if (fclose(msg->data) || rename(tmpfile, stats_path))
+        unlink(tmpfile);
+}
+
+
+// Each module dumps its statistics on its own loop, then passes the file on
+static void dump_ndp_loop_stats(struct relayd_message *msg)
+{
+    dump_ndp_stats(msg->data);
+    msg->handle = finish_stats;
+    if (relayd_post(RELAYD_LOOP_MAIN, msg))
+        fclose(msg->data);
+}
+
+
+static void dump_dhcpv6_loop_stats(struct relayd_message *msg)
+{
+    dump_dhcpv6_relay_stats(msg->data);
+    msg->handle = dump_ndp_loop_stats;
+    if (relayd_post(RELAYD_LOOP_NDP, msg))
+        fclose(msg->data);
+}
+
+
+// Write statistics of all modules
+static void write_stats(const char *statsfile)
+{
+    char tmpfile[PATH_MAX];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", statsfile);
+
+    FILE *fp = fopen(tmpfile, "w");
+    if (!fp) {
+        syslog(LOG_WARNING, "Unable to write statistics to %s (%s)",
+                statsfile, strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < RELAYD_PRIO_MAX; ++i)
+        fprintf(fp, "relayd_receive %s dropped %llu peak_load %u\n",
+                priority_names[i],
+                (unsigned long long)__atomic_load_n(&rx_dropped[i], __ATOMIC_RELAXED),
+                __atomic_exchange_n(&rx_peak_load[i], 0, __ATOMIC_RELAXED));
+
+    fprintf(fp, "relayd_send queued %llu retried %llu stale %llu superseded %llu "
+            "overflow %llu peak_depth %u\n",
+            (unsigned long long)__atomic_load_n(&tx_queued, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tx_retried, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tx_stale, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tx_superseded, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&tx_overflow, __ATOMIC_RELAXED),
+            __atomic_exchange_n(&tx_peak_depth, 0, __ATOMIC_RELAXED));
+
+    struct relayd_message msg = {.handle = dump_dhcpv6_loop_stats, .data = fp};
+    if (relayd_post(RELAYD_LOOP_DHCPV6, &msg))
+        fclose(fp);
+}
+
+
+// Find a namespace below RELAYD_NETNS_DIR by name, opening it on first use
+static ssize_t open_netns(const char *name, size_t len)
+{
+    for (size_t i = 1; i < netns_cnt; ++i)
+        if (strlen(netns[i].name) == len && !strncmp(netns[i].name, name, len))
+            return i;
+
+    struct relayd_netns *n = realloc(netns, (netns_cnt + 1) * sizeof(*n));
+    if (!n)
+        return -1;
+
+    netns = n;
+    n = &netns[netns_cnt];
+    memset(n, 0, sizeof(*n));
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%.*s", RELAYD_NETNS_DIR, (int)len, name);
+    if (!(n->name = strndup(name, len)) ||
+            (n->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        syslog(LOG_ERR, "Unable to open network namespace %s (%s)",
+                path, strerror(errno));
+        return -1;
+    }
+
+    // Sockets stay in the namespace they were created in
+    if (relayd_enter_netns(netns_cnt++) || (n->ioctl_sock =
+            socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    return netns_cnt - 1;
+}
+
+
+// Switch the calling thread to a namespace, sockets opened afterwards
+// and sysctls read belong to it
+int relayd_enter_netns(size_t ns)
 {
-    if (ifname[0] == '.' && iface == &config.master)
-        return 0; // Skipped
+    if (ns == current_netns)
+        return 0;
+
+    if (setns(netns[ns].fd, CLONE_NEWNET)) {
+        syslog(LOG_ERR, "Unable to enter network namespace %s (%s)",
+                (ns > 0) ? netns[ns].name : "of 6relayd", strerror(errno));
+        return -1;
+    }
 
+    current_netns = ns;
+    return 0;
+}
+
+
+size_t relayd_netns_count(void)
+{
+    return netns_cnt;
+}
+
+
+// Create an interface context, interfaces of other network namespaces
+// are given as <netns>/<ifname>
+static int open_interface(struct relayd_interface *iface,
+        const char *name, bool external)
+{
     int status = 0;
+    const char *ifname = strchr(name, '/');
+    ssize_t ns = 0;
+    if (!ifname)
+        ifname = name;
+    else if ((ns = open_netns(name, ifname++ - name)) < 0)
+        return -1;
 
     size_t ifname_len = strlen(ifname) + 1;
     if (ifname_len > IF_NAMESIZE)
@@ -354,25 +741,27 @@ static int open_interface(struct relayd_interface *iface,
     memcpy(ifr.ifr_name, ifname, ifname_len);
 
     // Detect interface index
-    if (ioctl(ioctl_sock, SIOCGIFINDEX, &ifr) < 0)
+    if (ioctl(netns[ns].ioctl_sock, SIOCGIFINDEX, &ifr) < 0)
         goto err;
 
     iface->ifindex = ifr.ifr_ifindex;
 
     // Detect MAC-address of interface
-    if (ioctl(ioctl_sock, SIOCGIFHWADDR, &ifr) < 0)
+    if (ioctl(netns[ns].ioctl_sock, SIOCGIFHWADDR, &ifr) < 0)
         goto err;
 
     // Fill interface structure
     memcpy(iface->mac, ifr.ifr_hwaddr.sa_data, sizeof(iface->mac));
     memcpy(iface->ifname, ifname, ifname_len);
+    iface->name = name;
+    iface->netns = ns;
     iface->external = external;
 
     goto out;
 
 err:
     syslog(LOG_ERR, "Unable to open interface %s (%s)",
-            ifname, strerror(errno));
+            name, strerror(errno));
     status = -1;
 out:
     return status;
@@ -396,11 +785,13 @@ int relayd_open_rtnl_socket(void)
 
 
 // Read IPv6 MTU for interface
-int relayd_get_interface_mtu(const char *ifname)
+int relayd_get_interface_mtu(const struct relayd_interface *iface)
 {
     char buf[64];
     const char *sysctl_pattern = "/proc/sys/net/ipv6/conf/%s/mtu";
-    snprintf(buf, sizeof(buf), sysctl_pattern, ifname);
+    snprintf(buf, sizeof(buf), sysctl_pattern, iface->ifname);
+    if (relayd_enter_netns(iface->netns))
+        return -1;
 
     int fd = open(buf, O_RDONLY);
     ssize_t len = read(fd, buf, sizeof(buf) - 1);
@@ -417,23 +808,34 @@ int relayd_get_interface_mtu(const char *ifname)
 
 
 // Read IPv6 MAC for interface
-int relayd_get_interface_mac(const char *ifname, uint8_t mac[6])
+int relayd_get_interface_mac(const struct relayd_interface *iface, uint8_t mac[6])
 {
     struct ifreq ifr;
-    strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
-    if (ioctl(ioctl_sock, SIOCGIFHWADDR, &ifr) < 0)
+    strncpy(ifr.ifr_name, iface->ifname, sizeof(ifr.ifr_name));
+    if (ioctl(netns[iface->netns].ioctl_sock, SIOCGIFHWADDR, &ifr) < 0)
         return -1;
     memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
     return 0;
 }
 
 
-// Register events for the multiplexer
+// Register events for the multiplexer of the current loop
 int relayd_register_event(struct relayd_event *event)
 {
+    // Let the kernel report datagrams it dropped for lack of buffer space
+    if (event->handle_dgram) {
+        int val = 1;
+        setsockopt(event->socket, SOL_SOCKET, SO_RXQ_OVFL, &val, sizeof(val));
+
+        val = config.rcvbuf[event->priority];
+        if (val > 0 && setsockopt(event->socket, SOL_SOCKET,
+                SO_RCVBUFFORCE, &val, sizeof(val)))
+            setsockopt(event->socket, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+    }
+
     struct epoll_event ev = {EPOLLIN | EPOLLET, {event}};
-    if (!epoll_ctl(epoll, EPOLL_CTL_ADD, event->socket, &ev)) {
-        ++epoll_registered;
+    if (!epoll_ctl(loops[current_loop].epoll, EPOLL_CTL_ADD, event->socket, &ev)) {
+        ++loops[current_loop].registered;
         return 0;
     } else {
         return -1;
@@ -441,8 +843,288 @@ int relayd_register_event(struct relayd_event *event)
 }
 
 
-// Forwards a packet on a specific interface
-ssize_t relayd_forward_packet(int socket, struct sockaddr_in6 *dest,
+// Handle a message on the given loop, queued if that runs on another thread.
+// Fails if the queue is full.
+int relayd_post(enum relayd_loop loop, const struct relayd_message *msg)
+{
+    if (!threads_running || loop == current_loop) {
+        struct relayd_message m = *msg;
+        if (m.handle)
+            m.handle(&m);
+        return 0;
+    }
+
+    struct relayd_queue *q = loops[loop].queues[current_loop];
+    uint32_t tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= RELAYD_QUEUE_SIZE) {
+        if (q->dropped++ == 0)
+            syslog(LOG_WARNING, "Message queue to loop %d is full", loop);
+        return -1;
+    }
+
+    q->ring[tail % RELAYD_QUEUE_SIZE] = *msg;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    if (write(q->event.socket, &one, sizeof(one)) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+// Handle messages queued by another loop
+static void handle_queue(struct relayd_event *event)
+{
+    struct relayd_queue *q = (struct relayd_queue*)event;
+    uint64_t cnt;
+    if (read(event->socket, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        return;
+
+    uint32_t head = q->head;
+    while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        struct relayd_message msg = q->ring[head % RELAYD_QUEUE_SIZE];
+        __atomic_store_n(&q->head, ++head, __ATOMIC_RELEASE);
+        if (msg.handle)
+            msg.handle(&msg);
+    }
+}
+
+
+// Queue an event to be served in the next iteration of its loop
+static void schedule_event(enum relayd_loop loop, struct relayd_event *event)
+{
+    if (event->ready)
+        return;
+
+    event->ready = true;
+    event->next_ready = NULL;
+    if (loops[loop].ready[event->priority])
+        loops[loop].ready_tail[event->priority]->next_ready = event;
+    else
+        loops[loop].ready[event->priority] = event;
+    loops[loop].ready_tail[event->priority] = event;
+}
+
+
+// Serve an event of the current loop again in the next iteration, for
+// handlers that stop at RELAYD_EVENT_BUDGET with input left
+void relayd_reschedule_event(struct relayd_event *event)
+{
+    schedule_event(current_loop, event);
+}
+
+
+// Every iteration serves each ready event once with a bounded budget in
+// order of priority, events with work left are requeued behind new ones.
+// A flooded socket thus delays higher priorities by one iteration at most.
+static void run_loop(enum relayd_loop loop)
+{
+    current_loop = loop;
+
+    struct epoll_event ev[RELAYD_EPOLL_MAX];
+    int batch = RELAYD_EPOLL_MIN;
+    bool pending = false;
+
+    while (!do_stop) {
+        int len = epoll_wait(loops[loop].epoll, ev, batch, (pending) ? 0 : -1);
+        for (int i = 0; i < len; ++i)
+            schedule_event(loop, ev[i].data.ptr);
+
+        // Take more events per wakeup under load
+        if (len == batch && batch < RELAYD_EPOLL_MAX)
+            batch *= 2;
+        else if (len < batch / 4 && batch > RELAYD_EPOLL_MIN)
+            batch /= 2;
+
+        struct relayd_event *ready[RELAYD_PRIO_MAX];
+        memcpy(ready, loops[loop].ready, sizeof(ready));
+        memset(loops[loop].ready, 0, sizeof(loops[loop].ready));
+
+        pending = false;
+        for (size_t prio = 0; prio < RELAYD_PRIO_MAX; ++prio) {
+            for (struct relayd_event *event = ready[prio], *next;
+                    event; event = next) {
+                next = event->next_ready;
+                event->ready = false;
+
+                if (event->handle_event) {
+                    event->handle_event(event);
+                    pending |= event->ready; // Rescheduled itself
+                } else if (event->handle_dgram &&
+                        relayd_receive_packets(event)) {
+                    schedule_event(loop, event);
+                    pending = true;
+                }
+            }
+        }
+
+        if (loop == RELAYD_LOOP_MAIN && do_dump_stats) {
+            do_dump_stats = false;
+            write_stats(stats_path);
+        }
+    }
+}
+
+
+static void* loop_thread(void *arg)
+{
+    run_loop((enum relayd_loop)(intptr_t)arg);
+    return NULL;
+}
+
+
+// Connect all loops with queues and run the module loops on own threads,
+// signals are left to the main thread
+static int start_threads(void)
+{
+    for (size_t i = 0; i < RELAYD_LOOP_MAX; ++i) {
+        current_loop = i;
+        for (size_t j = 0; j < RELAYD_LOOP_MAX; ++j) {
+            if (i == j)
+                continue;
+
+            struct relayd_queue *q = calloc(1, sizeof(*q));
+            if (!q || (q->event.socket = eventfd(0,
+                    EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+                syslog(LOG_ERR, "Unable to create queue: %s", strerror(errno));
+                return -1;
+            }
+
+            q->event.handle_event = handle_queue;
+            loops[i].queues[j] = q;
+            relayd_register_event(&q->event);
+        }
+    }
+    current_loop = RELAYD_LOOP_MAIN;
+
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+    threads_running = true;
+    for (size_t i = RELAYD_LOOP_MAIN + 1; i < RELAYD_LOOP_MAX; ++i) {
+        if (pthread_create(&loops[i].thread, NULL, loop_thread, (void*)i)) {
+            syslog(LOG_ERR, "Unable to start thread: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+
+// Append a copy of an event for another shard or namespace
+static struct relayd_event* add_shard(struct relayd_event *event,
+        struct relayd_event *last)
+{
+    struct relayd_event *shard = event;
+    if (last && (shard = malloc(sizeof(*shard)))) {
+        *shard = *event;
+        shard->next_shard = NULL;
+        last->next_shard = shard;
+    }
+    return shard;
+}
+
+
+// Open an event's socket for the first shard of slaves and copies of it
+// with sockets for the remaining shards, so that no socket joins more
+// than RELAYD_SHARD_SIZE interfaces and each lives in the namespace of its
+// interfaces. Sending is done through the first shard of a namespace.
+int relayd_open_shards(struct relayd_event *event,
+        int (*open_shard)(size_t first, size_t count))
+{
+    struct relayd_event *shard = NULL;
+    size_t first = 0;
+
+    do {
+        size_t count = 0;
+        while (first + count < config.slavecount && config.slaves[first + count].shard
+                == config.slaves[first].shard)
+            ++count;
+
+        if (!(shard = add_shard(event, shard)))
+            return -1;
+
+        shard->shard = (count > 0) ? config.slaves[first].shard : 0;
+        shard->netns = (count > 0) ? config.slaves[first].netns : 0;
+        if (relayd_enter_netns(shard->netns) ||
+                (shard->socket = open_shard(first, count)) < 0) {
+            if (shard != event)
+                syslog(LOG_ERR, "Failed to open socket for shard %zu: %s",
+                        shard->shard, strerror(errno));
+            return -1;
+        }
+
+        first += count;
+    } while (first < config.slavecount);
+
+    // Otherwise every shard gets all groups joined on the interface
+    for (shard = event; event->next_shard && shard; shard = shard->next_shard) {
+        int zero = 0;
+        setsockopt(shard->socket, IPPROTO_IPV6, IPV6_MULTICAST_ALL,
+                &zero, sizeof(zero));
+    }
+
+    return 0;
+}
+
+
+// Open an event's socket and copies of it for each namespace with interfaces
+int relayd_open_netns(struct relayd_event *event,
+        int (*open_netns)(size_t netns))
+{
+    struct relayd_event *shard = NULL;
+    for (size_t i = 0; i < netns_cnt; ++i) {
+        if (netns[i].iface_index_len == 0 && (i > 0 || netns_cnt > 1))
+            continue;
+
+        if (!(shard = add_shard(event, shard)))
+            return -1;
+
+        shard->netns = i;
+        if (relayd_enter_netns(i) || (shard->socket = open_netns(i)) < 0) {
+            if (shard != event)
+                syslog(LOG_ERR, "Failed to open socket in namespace %s: %s",
+                        netns[i].name, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Register all shards of an event
+int relayd_register_shards(struct relayd_event *event)
+{
+    for (; event; event = event->next_shard)
+        if (relayd_register_event(event))
+            return -1;
+
+    return 0;
+}
+
+
+// Socket of the first shard of an event in a namespace, -1 if none
+int relayd_shard_socket(const struct relayd_event *event, size_t netns)
+{
+    for (; event; event = event->next_shard)
+        if (event->netns == netns)
+            return event->socket;
+
+    return -1;
+}
+
+
+static ssize_t send_packet(int socket, struct sockaddr_in6 *dest,
         struct iovec *iov, size_t iov_len,
         const struct relayd_interface *iface)
 {
@@ -470,30 +1152,215 @@ ssize_t relayd_forward_packet(int socket, struct sockaddr_in6 *dest,
         msg.msg_controllen = 0;
     }
 
+    return sendmsg(socket, &msg, MSG_DONTWAIT);
+}
+
+
+static void pop_packet(struct relayd_outqueue *q)
+{
+    free(q->packets[q->head].data);
+    q->head = (q->head + 1) % RELAYD_OUTQUEUE_LEN;
+    --q->cnt;
+}
+
+
+// Poll a queue for EPOLLOUT only while it holds datagrams, otherwise every
+// send completion on the socket would wake the loop
+static void poll_outqueue(struct relayd_outqueue *q, bool poll)
+{
+    struct epoll_event ev = {(poll) ? EPOLLOUT | EPOLLET : 0, {&q->event}};
+    if (q->polling != poll && !epoll_ctl(loops[current_loop].epoll,
+            EPOLL_CTL_MOD, q->event.socket, &ev))
+        q->polling = poll;
+}
+
+
+// Retry queued datagrams once the send buffer has room again
+static void drain_outqueue(struct relayd_event *event)
+{
+    struct relayd_outqueue *q = (struct relayd_outqueue*)event;
+    uint64_t now = relayd_monotonic_ms();
+
+    while (q->cnt > 0) {
+        struct relayd_outpacket *p = &q->packets[q->head];
+        if (now - p->queued_at > RELAYD_OUTQUEUE_MAX_AGE) {
+            __atomic_add_fetch(&tx_stale, 1, __ATOMIC_RELAXED);
+            pop_packet(q);
+            continue;
+        }
+
+        // Sockets bound to a device were bound for the original send
+        char bound[IF_NAMESIZE];
+        socklen_t bound_len = sizeof(bound);
+        if (!getsockopt(q->socket, SOL_SOCKET, SO_BINDTODEVICE, bound, &bound_len) &&
+                bound_len > 0)
+            setsockopt(q->socket, SOL_SOCKET, SO_BINDTODEVICE,
+                    p->iface->ifname, sizeof(p->iface->ifname));
+
+        struct iovec iov = {p->data, p->len};
+        if (send_packet(q->socket, &p->dest, &iov, 1, p->iface) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break; // Wait for the next EPOLLOUT
+
+            syslog(LOG_WARNING, "Failed to send queued datagram on %s (%s)",
+                    p->iface->ifname, strerror(errno));
+        } else {
+            __atomic_add_fetch(&tx_retried, 1, __ATOMIC_RELAXED);
+        }
+        pop_packet(q);
+    }
+
+    if (q->cnt == 0)
+        poll_outqueue(q, false);
+}
+
+
+// Queue a datagram the socket could not take right now
+static int queue_packet(int socket, const struct sockaddr_in6 *dest,
+        const struct iovec *iov, size_t iov_len,
+        const struct relayd_interface *iface)
+{
+    struct relayd_outqueue *q = loops[current_loop].outqueues;
+    while (q && q->socket != socket)
+        q = q->next;
+
+    if (!q) {
+        if (!(q = calloc(1, sizeof(*q))))
+            return -1;
+
+        // The socket itself may already be polled for input by its module
+        struct epoll_event ev = {EPOLLOUT | EPOLLET, {&q->event}};
+        q->socket = socket;
+        q->event.handle_event = drain_outqueue;
+        if ((q->event.socket = dup(socket)) < 0 || epoll_ctl(
+                loops[current_loop].epoll, EPOLL_CTL_ADD, q->event.socket, &ev)) {
+            if (q->event.socket >= 0)
+                close(q->event.socket);
+            free(q);
+            return -1;
+        }
+
+        q->polling = true;
+        q->next = loops[current_loop].outqueues;
+        loops[current_loop].outqueues = q;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < iov_len; ++i)
+        len += iov[i].iov_len;
+
+    uint8_t *data = malloc(len);
+    if (!data)
+        return -1;
+
+    for (size_t i = 0, off = 0; i < iov_len; off += iov[i++].iov_len)
+        memcpy(&data[off], iov[i].iov_base, iov[i].iov_len);
+
+    uint64_t now = relayd_monotonic_ms();
+    while (q->cnt > 0 && now - q->packets[q->head].queued_at > RELAYD_OUTQUEUE_MAX_AGE) {
+        __atomic_add_fetch(&tx_stale, 1, __ATOMIC_RELAXED);
+        pop_packet(q);
+    }
+
+    // A newer RA to the same destination replaces a queued one in place
+    struct relayd_outpacket *p = NULL;
+    for (size_t i = 0; dest->sin6_port == 0 && len > 0 &&
+            data[0] == ND_ROUTER_ADVERT && i < q->cnt && !p; ++i) {
+        struct relayd_outpacket *o = &q->packets[(q->head + i) % RELAYD_OUTQUEUE_LEN];
+        if (o->iface == iface && o->len > 0 && o->data[0] == ND_ROUTER_ADVERT &&
+                IN6_ARE_ADDR_EQUAL(&o->dest.sin6_addr, &dest->sin6_addr))
+            p = o;
+    }
+
+    if (p) {
+        free(p->data);
+        __atomic_add_fetch(&tx_superseded, 1, __ATOMIC_RELAXED);
+    } else {
+        if (q->cnt == RELAYD_OUTQUEUE_LEN) {
+            // Bounded queue, give up on the oldest datagram
+            __atomic_add_fetch(&tx_overflow, 1, __ATOMIC_RELAXED);
+            pop_packet(q);
+        }
+
+        p = &q->packets[(q->head + q->cnt++) % RELAYD_OUTQUEUE_LEN];
+        __atomic_add_fetch(&tx_queued, 1, __ATOMIC_RELAXED);
+    }
+
+    *p = (struct relayd_outpacket){*dest, iface, now, len, data};
+    poll_outqueue(q, true);
+
+    unsigned peak = __atomic_load_n(&tx_peak_depth, __ATOMIC_RELAXED);
+    while (q->cnt > peak && !__atomic_compare_exchange_n(&tx_peak_depth,
+            &peak, q->cnt, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+
+// Forwards a packet on a specific interface, queues it if the send buffer
+// is full and returns the number of bytes sent or queued
+ssize_t relayd_forward_packet(int socket, struct sockaddr_in6 *dest,
+        struct iovec *iov, size_t iov_len,
+        const struct relayd_interface *iface)
+{
     char ipbuf[INET6_ADDRSTRLEN];
     inet_ntop(AF_INET6, &dest->sin6_addr, ipbuf, sizeof(ipbuf));
 
-    ssize_t sent = sendmsg(socket, &msg, MSG_DONTWAIT);
-    if (sent < 0)
+    // Keep the order of datagrams already waiting on the socket
+    struct relayd_outqueue *q = loops[current_loop].outqueues;
+    while (q && q->socket != socket)
+        q = q->next;
+
+    ssize_t sent;
+    if (q && q->cnt > 0) {
+        sent = -1;
+        errno = EAGAIN;
+    } else {
+        sent = send_packet(socket, dest, iov, iov_len, iface);
+    }
+
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            !queue_packet(socket, dest, iov, iov_len, iface)) {
+        syslog(LOG_NOTICE, "Queued datagram to %s%%%s", ipbuf, iface->ifname);
+        sent = 0;
+        for (size_t i = 0; i < iov_len; ++i)
+            sent += iov[i].iov_len;
+    } else if (sent < 0) {
         syslog(LOG_WARNING, "Failed to relay to %s%%%s (%s)",
                 ipbuf, iface->ifname, strerror(errno));
-    else
+    } else {
         syslog(LOG_NOTICE, "Relayed %li bytes to %s%%%s",
                 (long)sent, ipbuf, iface->ifname);
+    }
+
     return sent;
 }
 
 
 // Detect an IPV6-address currently assigned to the given interface
-ssize_t relayd_get_interface_addresses(int ifindex,
+ssize_t relayd_get_interface_addresses(const struct relayd_interface *iface,
         struct relayd_ipaddr *addrs, size_t cnt)
 {
+    // Every loop has its own sockets for the request-response exchange
+    if (!rtnl_socket && (rtnl_socket = malloc(netns_cnt * sizeof(int))))
+        for (size_t i = 0; i < netns_cnt; ++i)
+            rtnl_socket[i] = -1;
+
+    if (!rtnl_socket)
+        return 0;
+
+    int sock = rtnl_socket[iface->netns];
+    if (sock < 0 && (relayd_enter_netns(iface->netns) ||
+            (sock = rtnl_socket[iface->netns] = relayd_open_rtnl_socket()) < 0))
+        return 0;
+
+    int ifindex = iface->ifindex;
     struct {
         struct nlmsghdr nhm;
         struct ifaddrmsg ifa;
     } req = {{sizeof(req), RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP,
             ++rtnl_seq, 0}, {AF_INET6, 0, 0, 0, ifindex}};
-    if (send(rtnl_socket, &req, sizeof(req), 0) < (ssize_t)sizeof(req))
+    if (send(sock, &req, sizeof(req), 0) < (ssize_t)sizeof(req))
         return 0;
 
     uint8_t buf[8192];
@@ -501,7 +1368,7 @@ ssize_t relayd_get_interface_addresses(int ifindex,
 
     for (struct nlmsghdr *nhm = NULL; ; nhm = NLMSG_NEXT(nhm, len)) {
         while (len < 0 || !NLMSG_OK(nhm, (size_t)len)) {
-            len = recv(rtnl_socket, buf, sizeof(buf), 0);
+            len = recv(sock, buf, sizeof(buf), 0);
             nhm = (struct nlmsghdr*)buf;
             if (len < 0 || !NLMSG_OK(nhm, (size_t)len)) {
                 if (errno == EINTR)
@@ -551,34 +1418,45 @@ ssize_t relayd_get_interface_addresses(int ifindex,
 }
 
 
-struct relayd_interface* relayd_get_interface_by_index(int ifindex)
+struct relayd_interface* relayd_get_interface_by_index(size_t ns, int ifindex)
 {
-    if (config.master.ifindex == ifindex)
-        return &config.master;
+    return (ns < netns_cnt && ifindex >= 0 && ifindex < netns[ns].iface_index_len) ?
+            netns[ns].iface_index[ifindex] : NULL;
+}
+
+
+// Find an interface by the name it was given, [<netns>/]<ifname>
+struct relayd_interface* relayd_get_interface_by_name(const char *name)
+{
+    for (size_t i = 0; i < config.mastercount; ++i)
+        if (config.masters[i].name && !strcmp(config.masters[i].name, name))
+            return &config.masters[i];
 
     for (size_t i = 0; i < config.slavecount; ++i)
-        if (config.slaves[i].ifindex == ifindex)
+        if (!strcmp(config.slaves[i].name, name))
             return &config.slaves[i];
 
     return NULL;
 }
 
 
-struct relayd_interface* relayd_get_interface_by_name(const char *name)
+// Receive queue fill in percent of the socket currently being served
+unsigned relayd_receive_load(void)
 {
-    if (!strcmp(config.master.ifname, name))
-        return &config.master;
+    return current_load;
+}
 
-    for (size_t i = 0; i < config.slavecount; ++i)
-        if (!strcmp(config.slaves[i].ifname, name))
-            return &config.slaves[i];
 
-    return NULL;
+// Namespace of the socket currently being served
+size_t relayd_receive_netns(void)
+{
+    return receive_netns;
 }
 
 
-// Convenience function to receive and do basic validation of packets
-static void relayd_receive_packets(struct relayd_event *event)
+// Convenience function to receive and do basic validation of packets,
+// returns true if the budget ran out before the socket was drained
+static bool relayd_receive_packets(struct relayd_event *event)
 {
     uint8_t data_buf[RELAYD_BUFFER_SIZE], cmsg_buf[128];
     union {
@@ -587,29 +1465,58 @@ static void relayd_receive_packets(struct relayd_event *event)
         struct sockaddr_nl nl;
     } addr;
 
-    while (true) {
+    // Estimate the queue depth from the memory held by the receive queue
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t meminfo_len = sizeof(meminfo);
+    current_load = 0;
+    receive_netns = event->netns;
+    if (!getsockopt(event->socket, SOL_SOCKET, SO_MEMINFO, meminfo, &meminfo_len) &&
+            meminfo_len > SK_MEMINFO_RCVBUF * sizeof(uint32_t) &&
+            meminfo[SK_MEMINFO_RCVBUF] > 0)
+        current_load = (uint64_t)meminfo[SK_MEMINFO_RMEM_ALLOC] * 100 /
+                meminfo[SK_MEMINFO_RCVBUF];
+
+    unsigned peak = __atomic_load_n(&rx_peak_load[event->priority], __ATOMIC_RELAXED);
+    while (current_load > peak && !__atomic_compare_exchange_n(
+            &rx_peak_load[event->priority], &peak, current_load,
+            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    bool more = true, overrun = false;
+    uint32_t lost = 0;
+
+    for (size_t budget = RELAYD_EVENT_BUDGET; budget > 0; --budget) {
         struct iovec iov = {data_buf, sizeof(data_buf)};
         struct msghdr msg = {&addr, sizeof(addr), &iov, 1,
                 cmsg_buf, sizeof(cmsg_buf), 0};
 
         ssize_t len = recvmsg(event->socket, &msg, MSG_DONTWAIT);
         if (len < 0) {
-            if (errno == EAGAIN)
+            if (errno == EAGAIN) {
+                more = false;
                 break;
-            else
-                continue;
+            } else if (errno == ENOBUFS) { // Netlink reports overruns this way
+                ++lost;
+                overrun = true;
+            }
+            continue;
         }
 
 
-        // Extract destination interface
+        // Extract destination interface and kernel drop count
         int destiface = 0;
         struct in6_pktinfo *pktinfo;
-        for (struct cmsghdr *ch = CMSG_FIRSTHDR(&msg); ch != NULL &&
-                destiface == 0; ch = CMSG_NXTHDR(&msg, ch)) {
+        for (struct cmsghdr *ch = CMSG_FIRSTHDR(&msg); ch != NULL;
+                ch = CMSG_NXTHDR(&msg, ch)) {
             if (ch->cmsg_level == IPPROTO_IPV6 &&
                     ch->cmsg_type == IPV6_PKTINFO) {
                 pktinfo = (struct in6_pktinfo*)CMSG_DATA(ch);
                 destiface = pktinfo->ipi6_ifindex;
+            } else if (ch->cmsg_level == SOL_SOCKET &&
+                    ch->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t dropped;
+                memcpy(&dropped, CMSG_DATA(ch), sizeof(dropped));
+                lost += dropped - event->dropped;
+                event->dropped = dropped;
             }
         }
 
@@ -618,11 +1525,15 @@ static void relayd_receive_packets(struct relayd_event *event)
             destiface = addr.ll.sll_ifindex;
 
         struct relayd_interface *iface =
-                relayd_get_interface_by_index(destiface);
+                relayd_get_interface_by_index(event->netns, destiface);
 
         if (!iface && addr.nl.nl_family != AF_NETLINK)
             continue;
 
+        // Unicasts reach every raw socket, leave them to the owning shard
+        if (iface && event->exclusive && iface->shard != event->shard)
+            continue;
+
         char ipbuf[INET6_ADDRSTRLEN] = "kernel";
         if (addr.ll.sll_family == AF_PACKET &&
                 len >= (ssize_t)sizeof(struct ip6_hdr))
@@ -636,6 +1547,25 @@ static void relayd_receive_packets(struct relayd_event *event)
 
         event->handle_dgram(&addr, data_buf, len, iface);
     }
+
+    if (lost > 0) {
+        __atomic_add_fetch(&rx_dropped[event->priority], lost, __ATOMIC_RELAXED);
+
+        // Warn at most once per second, the statistics have the totals
+        static __thread uint64_t last_warning = 0;
+        uint64_t now = relayd_monotonic_ms();
+        if (now - last_warning >= 1000) {
+            syslog(LOG_WARNING, "Kernel dropped %u datagrams of a %s "
+                    "priority socket", lost, priority_names[event->priority]);
+            last_warning = now;
+        }
+    }
+
+    // Lost notifications leave state behind, have the owner dump it again
+    if (overrun && event->resync)
+        event->resync(event);
+
+    return more;
 }
 
 
@@ -643,3 +1573,12 @@ void relayd_urandom(void *data, size_t len)
 {
     read(urandom_fd, data, len);
 }
+
+
+// Monotonic clock in milliseconds
+uint64_t relayd_monotonic_ms(void)
+{
+    struct timespec ts;
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -16,6 +16,7 @@
 #include <netinet/in.h>
 #include <netinet/icmp6.h>
 #include <net/if.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <syslog.h>
 
@@ -30,6 +31,22 @@
 
 #define RELAYD_BUFFER_SIZE 8192
 #define RELAYD_MAX_PREFIXES 8
+#define RELAYD_SHARD_SIZE 128 // Slaves joined by one receive socket
+#define RELAYD_EVENT_BUDGET 32 // Datagrams per event and loop iteration
+#define RELAYD_EPOLL_MIN 16
+#define RELAYD_EPOLL_MAX 256
+#define RELAYD_OUTQUEUE_LEN 64 // Datagrams waiting for send buffer per socket
+#define RELAYD_OUTQUEUE_MAX_AGE 1000 // ms, DHCPv6 and NDP retransmit earlier
+#define RELAYD_NETNS_DIR "/var/run/netns" // Named namespaces as of ip-netns
+#define RELAYD_NETNS_ANY ((size_t)-1)
+
+#ifndef IPV6_MULTICAST_ALL
+#define IPV6_MULTICAST_ALL 29
+#endif
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
 
 #define _unused __attribute__((unused))
 #define _packed __attribute__((packed))
@@ -44,11 +61,54 @@
 
 struct relayd_interface;
 
+// Service order of ready events within one loop iteration
+enum relayd_priority {
+    RELAYD_PRIO_HIGH, // NDP, RD and timers
+    RELAYD_PRIO_NORMAL, // DHCPv6
+    RELAYD_PRIO_LOW, // Netlink and other bulk work
+    RELAYD_PRIO_MAX
+};
+
 struct relayd_event {
     int socket;
     void (*handle_event)(struct relayd_event *event);
     void (*handle_dgram)(void *addr, void *data, size_t len,
             struct relayd_interface *iface);
+
+    // Receive shard, exclusive shards ignore other shards' interfaces
+    size_t shard;
+    bool exclusive;
+    size_t netns; // Network namespace of the socket
+    struct relayd_event *next_shard;
+
+    // Scheduling, events with work left are served again next iteration
+    enum relayd_priority priority;
+    bool ready;
+    struct relayd_event *next_ready;
+
+    uint32_t dropped; // Last kernel drop count of the socket
+    void (*resync)(struct relayd_event *event); // Netlink lost messages
+};
+
+
+// Event loops of the modules, each runs on its own thread with -j
+enum relayd_loop {
+    RELAYD_LOOP_MAIN,
+    RELAYD_LOOP_RD,
+    RELAYD_LOOP_DHCPV6,
+    RELAYD_LOOP_NDP,
+    RELAYD_LOOP_MAX
+};
+
+#define RELAYD_QUEUE_SIZE 256 // Messages between two loops
+
+// Cross-module event, handled on the loop it is posted to
+struct relayd_message {
+    void (*handle)(struct relayd_message *msg);
+    struct relayd_interface *iface;
+    struct in6_addr addr;
+    bool add;
+    void *data;
 };
 
 
@@ -63,8 +123,13 @@ struct relayd_ipaddr {
 struct relayd_interface {
     int ifindex;
     char ifname[IF_NAMESIZE];
+    const char *name; // As given, [<netns>/]<ifname>
+    size_t netns; // Network namespace, 0 is the one we started in
     uint8_t mac[6];
     bool external;
+    struct relayd_interface *upstream; // Master of a slave, NULL for masters
+    size_t shard; // Receive shard of a slave, 0 for masters
+    struct in6_addr linklocal; // Source of our NS probes, from rtnetlink
 
     struct relayd_event timer_rs;
 
@@ -86,6 +151,11 @@ struct relayd_config {
     bool enable_dhcpv6_server;
     bool enable_ndp_relay;
     bool enable_route_learning;
+    bool enable_ndp_snooping;
+    bool enable_route_aggregation;
+    int ndp_keepalive_rate;
+    bool enable_threads;
+    int rcvbuf[RELAYD_PRIO_MAX]; // Receive buffer per priority class
 
     bool send_router_solicitation;
     bool always_rewrite_dns;
@@ -96,7 +166,8 @@ struct relayd_config {
     int ra_preference;
 
     struct in6_addr dnsaddr;
-    struct relayd_interface master;
+    struct relayd_interface *masters;
+    size_t mastercount;
     struct relayd_interface *slaves;
     size_t slavecount;
 
@@ -104,27 +175,51 @@ struct relayd_config {
     char *dhcpv6_statefile;
     char** dhcpv6_lease;
     size_t dhcpv6_lease_len;
+    char *dhcpv6_leasefile;
+    char *dhcpv6_querysocket;
+    char *dhcpv6_leasetable;
+    char** dhcpv6_policy;
+    size_t dhcpv6_policy_len;
+    char** dhcpv6_server;
+    size_t dhcpv6_server_len;
+    char** dhcpv6_requestor;
+    size_t dhcpv6_requestor_len;
 
     char** static_ndp;
     size_t static_ndp_len;
+    char *ndp_snapshot;
 };
 
 
 // Exported main functions
 int relayd_open_rtnl_socket(void);
 int relayd_register_event(struct relayd_event *event);
+void relayd_reschedule_event(struct relayd_event *event);
+int relayd_open_shards(struct relayd_event *event,
+        int (*open_shard)(size_t first, size_t count));
+int relayd_open_netns(struct relayd_event *event,
+        int (*open_netns)(size_t netns));
+int relayd_register_shards(struct relayd_event *event);
+int relayd_shard_socket(const struct relayd_event *event, size_t netns);
+int relayd_post(enum relayd_loop loop, const struct relayd_message *msg);
+unsigned relayd_receive_load(void);
+size_t relayd_receive_netns(void);
+size_t relayd_netns_count(void);
+int relayd_enter_netns(size_t netns);
 ssize_t relayd_forward_packet(int socket, struct sockaddr_in6 *dest,
         struct iovec *iov, size_t iov_len,
         const struct relayd_interface *iface);
-ssize_t relayd_get_interface_addresses(int ifindex,
+ssize_t relayd_get_interface_addresses(const struct relayd_interface *iface,
         struct relayd_ipaddr *addrs, size_t cnt);
 struct relayd_interface* relayd_get_interface_by_name(const char *name);
-int relayd_get_interface_mtu(const char *ifname);
-int relayd_get_interface_mac(const char *ifname, uint8_t mac[6]);
-struct relayd_interface* relayd_get_interface_by_index(int ifindex);
+int relayd_get_interface_mtu(const struct relayd_interface *iface);
+int relayd_get_interface_mac(const struct relayd_interface *iface, uint8_t mac[6]);
+struct relayd_interface* relayd_get_interface_by_index(size_t netns, int ifindex);
 void relayd_urandom(void *data, size_t len);
+uint64_t relayd_monotonic_ms(void);
 void relayd_setup_route(const struct in6_addr *addr, int prefixlen,
-        const struct relayd_interface *iface, const struct in6_addr *gw, bool add);
+        const struct relayd_interface *iface, const struct in6_addr *gw,
+        uint32_t metric, bool add);
 
 
 // Exported module initializers
@@ -134,3 +229,13 @@ int init_ndp_proxy(const struct relayd_config *relayd_config);
 
 void deinit_router_discovery_relay(void);
 void deinit_ndp_proxy();
+
+// Exported module statistics
+void dump_dhcpv6_relay_stats(FILE *fp);
+void dump_ndp_stats(FILE *fp);
+
+// Exported module interaction
+struct relayd_interface* dhcpv6_lookup_lease(size_t netns,
+        const struct in6_addr *addr);
+void ndp_learn_lease(const struct in6_addr *addr,
+        struct relayd_interface *iface, bool add);
@@ -15,51 +15,484 @@
 #include "list.h"
 #include "6relayd.h"
 #include "dhcpv6.h"
+#include "leasetable.h"
 #include "md5.h"
 
 #include <time.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <alloca.h>
+#include <stddef.h>
 #include <resolv.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/timerfd.h>
 
 
 struct assignment {
+    // Fields used when scanning the lease list share the first cache line
     struct list_head head;
-    struct sockaddr_in6 peer;
+    uint32_t assigned;
+    uint32_t iaid;
     time_t valid_until;
+    uint32_t clid_hash;
+    uint8_t length; // length == 128 -> IA_NA, length <= 64 -> IA_PD
+    uint8_t clid_len;
+    uint8_t slab; // Size class the assignment was allocated from
+    bool tentative; // Only solicited, not yet requested
+
+    struct list_head tentative_head;
+    struct assignment *index_next; // Next in the binding index chain
+    struct relayd_interface *iface; // Set while in the binding index
+    struct sockaddr_in6 peer;
+    bool neighbor; // Announced to the NDP proxy
+    time_t last_seen;
     time_t reconf_sent;
     int reconf_cnt;
-    char *hostname;
+    bool accept_reconf;
     uint8_t key[16];
+    char hostname[64]; // First label of the client FQDN or empty
+    uint8_t clid_data[];
+};
+
+// Assignments are carved from slabs of fixed size classes by DUID length
+// and recycled through per-class free lists, slabs are never returned
+#define ASSIGNMENT_ALIGN 64
+#define ASSIGNMENT_SLAB_OBJECTS 32
+
+static const uint8_t slab_clid_len[] = {16, 32, 130};
+
+struct assignment_slab {
+    void *free;
+    size_t total;
+    size_t used;
+};
+
+static struct assignment_slab slabs[sizeof(slab_clid_len)];
+
+// Static reservations shared by all interfaces. Leases live in one array,
+// their DUIDs in a byte pool and two open addressing tables map DUIDs and
+// assigned numbers to lease index + 1.
+struct static_lease {
+    uint32_t hash;
     uint32_t assigned;
-    uint32_t iaid;
-    uint8_t length; // length == 128 -> IA_NA, length <= 64 -> IA_PD
-    bool accept_reconf;
+    uint32_t clid_off;
     uint8_t clid_len;
-    uint8_t clid_data[];
 };
 
+static struct static_lease *static_leases = NULL;
+static size_t static_cnt = 0;
+static size_t static_max = 0;
+static uint8_t *static_clid = NULL;
+static size_t static_clid_len = 0;
+static size_t static_clid_max = 0;
+static uint32_t *static_by_clid = NULL;
+static uint32_t *static_by_assigned = NULL;
+static size_t static_mask = 0;
+static unsigned static_bits = 0;
+
+// Reverse index from interface, length and assigned number to bindings,
+// chained through the assignments and doubled to keep chains short
+static struct assignment **binding_index = NULL;
+static unsigned binding_bits = 0;
+static size_t binding_cnt = 0;
+
+static void handle_query(struct relayd_event *event);
+static struct relayd_event query_event = {.socket = -1,
+        .handle_event = handle_query, .priority = RELAYD_PRIO_NORMAL};
+
+static struct leasetable *lease_table = NULL;
+
+// Lifetime policy per slave interface. Lifetimes are lengthened when the
+// renew rate expected from the current bindings nears the renew budget.
+#define DHCPV6_LIFETIME 3600
+#define DHCPV6_LIFETIME_CAP 86400
+#define DHCPV6_LIFETIME_MAX_SCALE 16
+#define DHCPV6_LOAD_TARGET 800 // Per mille of the renew budget
+
+struct lifetime_policy {
+    uint32_t lifetime;
+    uint32_t budget; // Renews per second, 0 for unlimited
+    size_t bindings; // Committed and unexpired, recounted by reconf_timer
+    time_t renew_second;
+    uint32_t renews;
+    uint32_t renew_rate;
+};
+
+static struct lifetime_policy *policies = NULL;
+static uint32_t jitter_state = 0;
+
 
 static const struct relayd_config *config = NULL;
 static void update(struct relayd_interface *iface);
 static void reconf_timer(struct relayd_event *event);
-static struct relayd_event reconf_event = {-1, reconf_timer, NULL};
-static int socket_fd = -1;
+static struct relayd_event reconf_event = {.socket = -1,
+        .handle_event = reconf_timer, .priority = RELAYD_PRIO_HIGH};
+static const struct relayd_event *dhcpv6_event = NULL;
 static uint32_t serial = 0;
 
+// Bounded pool of solicited but not yet requested bindings, oldest first
+#define DHCPV6_MAX_TENTATIVE 256
+static struct list_head tentatives = LIST_HEAD_INIT(tentatives);
+static size_t tentative_cnt = 0;
+static uint32_t tentative_evicted = 0;
+
+
+
+static struct assignment* alloc_assignment(size_t clid_len)
+{
+    size_t i = 0;
+    while (i < sizeof(slab_clid_len) - 1 && slab_clid_len[i] < clid_len)
+        ++i;
+
+    struct assignment_slab *slab = &slabs[i];
+    if (!slab->free) {
+        size_t size = (offsetof(struct assignment, clid_data) + slab_clid_len[i] +
+                ASSIGNMENT_ALIGN - 1) & ~(ASSIGNMENT_ALIGN - 1);
+        uint8_t *chunk;
+        if (posix_memalign((void**)&chunk, ASSIGNMENT_ALIGN,
+                size * ASSIGNMENT_SLAB_OBJECTS))
+            return NULL;
+
+        for (size_t j = 0; j < ASSIGNMENT_SLAB_OBJECTS; ++j) {
+            *((void**)&chunk[j * size]) = slab->free;
+            slab->free = &chunk[j * size];
+        }
+        slab->total += ASSIGNMENT_SLAB_OBJECTS;
+    }
+
+    struct assignment *a = slab->free;
+    slab->free = *((void**)a);
+    ++slab->used;
+
+    memset(a, 0, offsetof(struct assignment, clid_data) + clid_len);
+    a->slab = i;
+    return a;
+}
+
+
+static void release_assignment(struct assignment *a)
+{
+    struct assignment_slab *slab = &slabs[a->slab];
+    *((void**)a) = slab->free;
+    slab->free = a;
+    --slab->used;
+}
+
+
+static uint32_t clid_hash(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ data[i]) * 16777619U;
+    return hash;
+}
+
+
+// Parse and append a <duid>:<val> reservation, not yet indexed
+static int add_static_lease(const char *lease)
+{
+    size_t duidlen = strcspn(lease, ":");
+    const char *assign = &lease[duidlen];
+    if (!duidlen || duidlen % 2 || duidlen / 2 > 130 || *assign++ != ':' ||
+            !isxdigit(*assign))
+        return -1;
+
+    for (size_t i = 0; i < duidlen; ++i)
+        if (!isxdigit(lease[i]))
+            return -1;
+    duidlen /= 2;
+
+    if (static_cnt == static_max) {
+        size_t max = (static_max) ? static_max * 2 : 16;
+        struct static_lease *leases = realloc(static_leases, max * sizeof(*leases));
+        if (!leases)
+            return -1;
+
+        static_leases = leases;
+        static_max = max;
+    }
+
+    if (static_clid_len + duidlen > static_clid_max) {
+        size_t max = (static_clid_max) ? static_clid_max * 2 : 256;
+        uint8_t *clid = realloc(static_clid, max);
+        if (!clid)
+            return -1;
+
+        static_clid = clid;
+        static_clid_max = max;
+    }
+
+    struct static_lease *l = &static_leases[static_cnt++];
+    uint8_t *clid_data = &static_clid[static_clid_len];
+    for (size_t j = 0; j < duidlen; ++j) {
+        char hexnum[3] = {lease[j * 2], lease[j * 2 + 1], 0};
+        clid_data[j] = strtol(hexnum, NULL, 16);
+    }
+
+    l->hash = clid_hash(clid_data, duidlen);
+    l->assigned = strtoul(assign, NULL, 16);
+    l->clid_off = static_clid_len;
+    l->clid_len = duidlen;
+    static_clid_len += duidlen;
+    return 0;
+}
+
+
+// Read reservations from a file, one <duid>:<val> per line
+static int load_static_leases(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        syslog(LOG_ERR, "Failed to open static leases %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t linelen = 0, lineno = 0;
+    int ret = 0;
+    while (getline(&line, &linelen, fp) >= 0) {
+        ++lineno;
+        char *start = line + strspn(line, " \t");
+        start[strcspn(start, " \t\r\n#")] = 0;
+
+        if (*start && add_static_lease(start)) {
+            syslog(LOG_ERR, "Invalid static lease in %s:%zu", path, lineno);
+            ret = -1;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+
+static uint32_t static_slot(uint32_t hash)
+{
+    // Take the upper bits, the lower ones are poor for aligned numbers
+    return (hash * 2654435761U) >> (32 - static_bits);
+}
+
+
+static const struct static_lease* find_static_lease(const uint8_t *clid_data,
+        size_t clid_len, uint32_t hash)
+{
+    if (!static_cnt)
+        return NULL;
+
+    for (uint32_t i = static_slot(hash); static_by_clid[i]; i = (i + 1) & static_mask) {
+        const struct static_lease *l = &static_leases[static_by_clid[i] - 1];
+        if (l->hash == hash && l->clid_len == clid_len &&
+                !memcmp(&static_clid[l->clid_off], clid_data, clid_len))
+            return l;
+    }
+
+    return NULL;
+}
+
+
+static bool is_static_assigned(uint32_t assigned)
+{
+    if (!static_cnt)
+        return false;
+
+    for (uint32_t i = static_slot(assigned); static_by_assigned[i];
+            i = (i + 1) & static_mask)
+        if (static_leases[static_by_assigned[i] - 1].assigned == assigned)
+            return true;
+
+    return false;
+}
+
+
+// Build both lookup tables in a single pass over all reservations
+static int index_static_leases(void)
+{
+    if (!static_cnt)
+        return 0;
+
+    static_bits = 4;
+    while (((size_t)1 << static_bits) < static_cnt * 2)
+        ++static_bits;
+
+    size_t size = (size_t)1 << static_bits;
+    static_mask = size - 1;
+    static_by_clid = calloc(size, sizeof(*static_by_clid));
+    static_by_assigned = calloc(size, sizeof(*static_by_assigned));
+    if (!static_by_clid || !static_by_assigned) {
+        syslog(LOG_ERR, "Failed to index static leases");
+        return -1;
+    }
+
+    for (size_t i = 0; i < static_cnt; ++i) {
+        struct static_lease *l = &static_leases[i];
+        if (find_static_lease(&static_clid[l->clid_off], l->clid_len, l->hash) ||
+                is_static_assigned(l->assigned)) {
+            syslog(LOG_WARNING, "Ignoring duplicate static lease %x", l->assigned);
+            continue;
+        }
+
+        uint32_t j = static_slot(l->hash);
+        while (static_by_clid[j])
+            j = (j + 1) & static_mask;
+        static_by_clid[j] = i + 1;
+
+        for (j = static_slot(l->assigned); static_by_assigned[j];
+                j = (j + 1) & static_mask);
+        static_by_assigned[j] = i + 1;
+    }
+
+    return 0;
+}
+
+
+// Parse [<iface>:]<lifetime>[,<budget>], later policies override earlier ones.
+// Interface names may contain ':' themselves, so match them as prefixes.
+static int add_lifetime_policy(const char *policy)
+{
+    const char *sep = NULL;
+    for (size_t i = 0; i < config->slavecount; ++i) {
+        size_t len = strlen(config->slaves[i].name);
+        if (!strncmp(config->slaves[i].name, policy, len) &&
+                policy[len] == ':' && (!sep || policy + len > sep))
+            sep = policy + len;
+    }
+
+    if (!sep && strchr(policy, ':'))
+        return -1; // Unknown interface
+
+    const char *value = (sep) ? sep + 1 : policy;
+    char *end;
+
+    uint32_t lifetime = strtoul(value, &end, 10), budget = 0;
+    if (end == value || lifetime < 60 || lifetime > DHCPV6_LIFETIME_CAP)
+        return -1;
+
+    if (*end == ',') {
+        value = end + 1;
+        budget = strtoul(value, &end, 10);
+        if (end == value)
+            return -1;
+    }
+
+    if (*end)
+        return -1;
+
+    bool found = false;
+    for (size_t i = 0; i < config->slavecount; ++i) {
+        const char *name = config->slaves[i].name;
+        if (sep && (strlen(name) != (size_t)(sep - policy) ||
+                strncmp(name, policy, sep - policy)))
+            continue;
+
+        policies[i].lifetime = lifetime;
+        policies[i].budget = budget;
+        found = true;
+    }
+
+    return (found) ? 0 : -1;
+}
+
+
+static struct lifetime_policy* policy_for(const struct relayd_interface *iface)
+{
+    return &policies[iface - config->slaves];
+}
+
 
+static uint32_t policy_lifetime(const struct relayd_interface *iface)
+{
+    const struct lifetime_policy *p = policy_for(iface);
+    if (!p->budget)
+        return p->lifetime;
+
+    // Bindings renew around T1, i.e. half a lifetime
+    uint64_t load = (uint64_t)p->bindings * 2 * 1000 / p->lifetime / p->budget;
+    if (load <= DHCPV6_LOAD_TARGET)
+        return p->lifetime;
 
-int dhcpv6_init_ia(const struct relayd_config *relayd_config, int dhcpv6_socket)
+    uint64_t lifetime = p->lifetime * load / DHCPV6_LOAD_TARGET;
+    if (lifetime > (uint64_t)p->lifetime * DHCPV6_LIFETIME_MAX_SCALE)
+        lifetime = (uint64_t)p->lifetime * DHCPV6_LIFETIME_MAX_SCALE;
+
+    return lifetime;
+}
+
+
+// Fold the renews of past seconds into the smoothed rate
+static void update_renew_rate(struct lifetime_policy *p, time_t now)
+{
+    for (time_t t = p->renew_second; t < now && (p->renews || p->renew_rate); ++t) {
+        p->renew_rate = (p->renew_rate * 3 + p->renews) / 4;
+        p->renews = 0;
+    }
+    p->renew_second = now;
+}
+
+
+static void account_renew(const struct relayd_interface *iface, time_t now)
+{
+    struct lifetime_policy *p = policy_for(iface);
+    update_renew_rate(p, now);
+    ++p->renews;
+}
+
+
+static uint32_t jitter(uint32_t range)
+{
+    jitter_state ^= jitter_state << 13;
+    jitter_state ^= jitter_state >> 17;
+    jitter_state ^= jitter_state << 5;
+    return (range) ? jitter_state % (range + 1) : 0;
+}
+
+
+// Create the shared lease table and replace any previous one atomically
+static int open_lease_table(const char *path)
+{
+    size_t size = sizeof(*lease_table) +
+            LEASETABLE_CAPACITY * sizeof(lease_table->entries[0]);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    void *map = MAP_FAILED;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && !ftruncate(fd, size))
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (fd >= 0)
+        close(fd);
+
+    if (map == MAP_FAILED || rename(tmp, path)) {
+        syslog(LOG_ERR, "Failed to create lease table %s: %s", path, strerror(errno));
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        unlink(tmp);
+        return -1;
+    }
+
+    lease_table = map;
+    lease_table->magic = LEASETABLE_MAGIC;
+    lease_table->version = LEASETABLE_VERSION;
+    lease_table->capacity = LEASETABLE_CAPACITY;
+    lease_table->writer_pid = getpid();
+    return 0;
+}
+
+
+int dhcpv6_init_ia(const struct relayd_config *relayd_config,
+        const struct relayd_event *event)
 {
     config = relayd_config;
-    socket_fd = dhcpv6_socket;
+    dhcpv6_event = event;
 
     reconf_event.socket = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
     if (reconf_event.socket < 0) {
@@ -72,11 +505,32 @@ int dhcpv6_init_ia(const struct relayd_config *relayd_config, int dhcpv6_socket)
     struct itimerspec its = {{2, 0}, {2, 0}};
     timerfd_settime(reconf_event.socket, 0, &its, NULL);
 
+    policies = calloc(config->slavecount, sizeof(*policies));
+    if (!policies)
+        return -1;
+
+    for (size_t i = 0; i < config->slavecount; ++i)
+        policies[i].lifetime = DHCPV6_LIFETIME;
+
+    for (size_t i = 0; i < config->dhcpv6_policy_len; ++i) {
+        if (add_lifetime_policy(config->dhcpv6_policy[i])) {
+            syslog(LOG_ERR, "Invalid lifetime policy %s", config->dhcpv6_policy[i]);
+            return -1;
+        }
+    }
+
+    relayd_urandom(&jitter_state, sizeof(jitter_state));
+    if (!jitter_state)
+        jitter_state = 1;
+
     for (size_t i = 0; i < config->slavecount; ++i) {
         struct relayd_interface *iface = &config->slaves[i];
 
         INIT_LIST_HEAD(&iface->pd_assignments);
-        struct assignment *border = calloc(1, sizeof(*border));
+        struct assignment *border = alloc_assignment(0);
+        if (!border)
+            return -1;
+
         border->length = 64;
         list_add(&border->head, &iface->pd_assignments);
     }
@@ -86,48 +540,35 @@ int dhcpv6_init_ia(const struct relayd_config *relayd_config, int dhcpv6_socket)
 
     // Parse static entries
     for (size_t i = 0; i < config->dhcpv6_lease_len; ++i) {
-        char *saveptr;
-        char *duid = strtok_r(config->dhcpv6_lease[i], ":", &saveptr), *assign;
-        size_t duidlen = (duid) ? strlen(duid) : 0;
-        if (!duidlen || duidlen % 2 || !(assign = strtok_r(NULL, ":", &saveptr))) {
+        if (add_static_lease(config->dhcpv6_lease[i])) {
             syslog(LOG_ERR, "Invalid static lease %s", config->dhcpv6_lease[i]);
             return -1;
         }
-        duidlen /= 2;
+    }
 
-        // Construct entry
-        struct assignment *a = calloc(1, sizeof(*a) + duidlen);
-        a->clid_len = duidlen;
-        a->length = 128;
-        a->assigned = strtol(assign, NULL, 16);
-        relayd_urandom(a->key, sizeof(a->key));
+    if (config->dhcpv6_leasefile && load_static_leases(config->dhcpv6_leasefile))
+        return -1;
 
-        for (size_t j = 0; j < duidlen; ++j) {
-            char hexnum[3] = {duid[j * 2], duid[j * 2 + 1], 0};
-            a->clid_data[j] = strtol(hexnum, NULL, 16);
-        }
+    if (config->dhcpv6_querysocket) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strncpy(addr.sun_path, config->dhcpv6_querysocket, sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
 
-        // Assign to all interfaces
-        struct assignment *c;
-        for (size_t j = 0; j < config->slavecount; ++j) {
-            struct relayd_interface *iface = &config->slaves[j];
-            list_for_each_entry(c, &iface->pd_assignments, head) {
-                if (c->length != 128 || c->assigned > a->assigned) {
-                    struct assignment *n = malloc(sizeof(*a) + duidlen);
-                    memcpy(n, a, sizeof(*a) + duidlen);
-                    list_add_tail(&n->head, &c->head);
-                } else if (c->assigned == a->assigned) {
-                    // Already an assignment with that number
-                    break;
-                }
-            }
+        query_event.socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (query_event.socket < 0 || bind(query_event.socket,
+                (struct sockaddr*)&addr, sizeof(addr))) {
+            syslog(LOG_ERR, "Failed to open query socket %s: %s",
+                    addr.sun_path, strerror(errno));
+            return -1;
         }
 
-
-        free(a);
+        relayd_register_event(&query_event);
     }
 
-    return 0;
+    if (config->dhcpv6_leasetable && open_lease_table(config->dhcpv6_leasetable))
+        return -1;
+
+    return index_static_leases();
 }
 
 
@@ -139,6 +580,179 @@ static time_t monotonic_time(void)
 }
 
 
+void dhcpv6_dump_ia_stats(FILE *fp)
+{
+    fprintf(fp, "dhcpv6_tentative count %zu limit %u evicted %u\n",
+            tentative_cnt, DHCPV6_MAX_TENTATIVE, tentative_evicted);
+
+    for (size_t i = 0; i < sizeof(slab_clid_len); ++i)
+        fprintf(fp, "dhcpv6_slab clid_len %u objects %zu used %zu\n",
+                slab_clid_len[i], slabs[i].total, slabs[i].used);
+
+    for (size_t i = 0; i < config->slavecount; ++i) {
+        update_renew_rate(&policies[i], monotonic_time());
+        fprintf(fp, "dhcpv6_lifetime %s base %u effective %u budget %u "
+                "bindings %zu renew_rate %u\n", config->slaves[i].name,
+                policies[i].lifetime, policy_lifetime(&config->slaves[i]),
+                policies[i].budget, policies[i].bindings, policies[i].renew_rate);
+    }
+}
+
+
+static uint32_t binding_slot(const struct relayd_interface *iface,
+        uint8_t length, uint32_t assigned)
+{
+    uint32_t hash = (assigned * 2654435761U) ^ ((uint32_t)iface->ifindex << 8 | length);
+    return (hash * 2654435761U) >> (32 - binding_bits);
+}
+
+
+static void grow_binding_index(void)
+{
+    unsigned bits = (binding_bits) ? binding_bits + 1 : 8;
+    struct assignment **index = calloc((size_t)1 << bits, sizeof(*index));
+    if (!index)
+        return; // Keep using the current one with longer chains
+
+    struct assignment **old = binding_index;
+    size_t old_size = (old) ? (size_t)1 << binding_bits : 0;
+    binding_index = index;
+    binding_bits = bits;
+
+    for (size_t i = 0; i < old_size; ++i) {
+        struct assignment *a, *n;
+        for (a = old[i]; a; a = n) {
+            n = a->index_next;
+            uint32_t slot = binding_slot(a->iface, a->length, a->assigned);
+            a->index_next = binding_index[slot];
+            binding_index[slot] = a;
+        }
+    }
+
+    free(old);
+}
+
+
+// Must be called once the binding is linked with its final number
+static void index_binding(struct relayd_interface *iface, struct assignment *a)
+{
+    if (!binding_index || binding_cnt >= ((size_t)1 << binding_bits))
+        grow_binding_index();
+
+    if (!binding_index)
+        return;
+
+    uint32_t slot = binding_slot(iface, a->length, a->assigned);
+    a->iface = iface;
+    a->index_next = binding_index[slot];
+    binding_index[slot] = a;
+    ++binding_cnt;
+}
+
+
+// Must be called before a binding is unlinked or renumbered
+static void unindex_binding(struct assignment *a)
+{
+    if (!a->iface)
+        return;
+
+    struct assignment **p = &binding_index[binding_slot(a->iface, a->length, a->assigned)];
+    while (*p != a)
+        p = &(*p)->index_next;
+
+    *p = a->index_next;
+    a->index_next = NULL;
+    a->iface = NULL;
+    --binding_cnt;
+}
+
+
+static struct assignment* lookup_binding(const struct relayd_interface *iface,
+        uint8_t length, uint32_t assigned)
+{
+    if (!binding_index)
+        return NULL;
+
+    struct assignment *a = binding_index[binding_slot(iface, length, assigned)];
+    while (a && (a->iface != iface || a->length != length || a->assigned != assigned))
+        a = a->index_next;
+
+    return a;
+}
+
+
+// Committed and unexpired, i.e. neither a mere offer nor a released,
+// declined or expired binding kept for later
+static bool is_leased(const struct assignment *a, time_t now)
+{
+    return a->clid_len > 0 && !a->tentative && a->valid_until >= now;
+}
+
+
+// Find the binding an address or prefix belongs to in a namespace
+static struct assignment* find_binding(size_t netns, const struct in6_addr *addr)
+{
+    for (size_t i = 0; i < config->slavecount; ++i) {
+        struct relayd_interface *iface = &config->slaves[i];
+        if (netns != RELAYD_NETNS_ANY && iface->netns != netns)
+            continue;
+        for (size_t j = 0; j < iface->pd_addr_len; ++j) {
+            const struct relayd_ipaddr *p = &iface->pd_addr[j];
+            if (p->prefix > 64 || p->addr.s6_addr32[0] != addr->s6_addr32[0])
+                continue;
+
+            // IA_NA addresses are <pool /64>::<assigned>
+            struct assignment *a;
+            uint32_t base = ntohl(p->addr.s6_addr32[1]);
+            uint32_t high = ntohl(addr->s6_addr32[1]);
+            if (high == base && addr->s6_addr32[2] == p->addr.s6_addr32[2] &&
+                    (a = lookup_binding(iface, 128,
+                    ntohl(addr->s6_addr32[3]))) && a->clid_len > 0)
+                return a;
+
+            uint32_t mask = (p->prefix > 32) ? (1U << (64 - p->prefix)) - 1 : UINT32_MAX;
+            if ((high & ~mask) != (base & ~mask))
+                continue;
+
+            // Try each delegated prefix length the address could be in
+            for (int length = 64; length > p->prefix; --length) {
+                uint32_t size = (length > 32) ? (1U << (64 - length)) - 1 : UINT32_MAX;
+                a = lookup_binding(iface, length, high & mask & ~size);
+                if (a && a->clid_len > 0 && ((base | a->assigned) & ~size) == (high & ~size))
+                    return a;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static void set_tentative(struct assignment *a, bool tentative)
+{
+    if (a->tentative == tentative)
+        return;
+
+    if (tentative) {
+        list_add_tail(&a->tentative_head, &tentatives);
+        ++tentative_cnt;
+    } else {
+        list_del(&a->tentative_head);
+        --tentative_cnt;
+    }
+    a->tentative = tentative;
+}
+
+
+static void free_assignment(struct assignment *a)
+{
+    set_tentative(a, false);
+    unindex_binding(a);
+    list_del(&a->head);
+    release_assignment(a);
+}
+
+
 static int send_reconf(struct relayd_interface *iface, struct assignment *assign)
 {
     struct {
@@ -199,12 +813,117 @@ static int send_reconf(struct relayd_interface *iface, struct assignment *assign
     md5_append(&md5, reconf_msg.auth.key, 16);
     md5_finish(&md5, reconf_msg.auth.key);
 
-    return relayd_forward_packet(socket_fd, &assign->peer, &iov, 1, iface);
+    return relayd_forward_packet(relayd_shard_socket(dhcpv6_event, iface->netns),
+            &assign->peer, &iov, 1, iface);
+}
+
+
+// Format a binding as lease line:
+// # iface DUID iaid hostname lifetime assigned length [addrs...]
+static size_t format_lease(char *buf, size_t buflen, const struct relayd_interface *iface,
+        const struct assignment *c, time_t now, time_t wall_time)
+{
+    char ipbuf[INET6_ADDRSTRLEN];
+    char duidbuf[264];
+    const char hex[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < c->clid_len; ++i) {
+        duidbuf[2 * i] = hex[(c->clid_data[i] >> 4) & 0x0f];
+        duidbuf[2 * i + 1] = hex[c->clid_data[i] & 0x0f];
+    }
+    duidbuf[c->clid_len * 2] = 0;
+
+    int l = snprintf(buf, buflen, "# %s %s %x %s %u %x %u ",
+            iface->name, duidbuf, ntohl(c->iaid),
+            (c->hostname[0] ? c->hostname : "-"),
+            (unsigned)(c->valid_until > now ?
+                    (c->valid_until - now + wall_time) : 0),
+            c->assigned, (unsigned)c->length);
+
+    struct in6_addr addr;
+    for (size_t i = 0; i < iface->pd_addr_len; ++i) {
+        if (iface->pd_addr[i].prefix > 64)
+            continue;
+
+        addr = iface->pd_addr[i].addr;
+        if (c->length == 128)
+            addr.s6_addr32[3] = htonl(c->assigned);
+        else
+            addr.s6_addr32[1] |= htonl(c->assigned);
+        inet_ntop(AF_INET6, &addr, ipbuf, sizeof(ipbuf) - 1);
+
+        l += snprintf(buf + l, buflen - l, "%s/%hhu ", ipbuf, c->length);
+    }
+    buf[l - 1] = '\n';
+    return l;
+}
+
+
+static void publish_lease_table(void)
+{
+    time_t now = monotonic_time(), wall_time = time(NULL);
+    uint32_t seq = lease_table->seq, count = 0, dropped = 0;
+
+    __atomic_store_n(&lease_table->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < config->slavecount; ++i) {
+        struct relayd_interface *iface = &config->slaves[i];
+        const char *sep = strchr(iface->name, '/');
+        size_t netns_len = (sep) ? (size_t)(sep - iface->name) : 0;
+        if (netns_len >= sizeof(lease_table->entries[0].netns))
+            netns_len = sizeof(lease_table->entries[0].netns) - 1;
+
+        struct assignment *c;
+        list_for_each_entry(c, &iface->pd_assignments, head) {
+            if (!is_leased(c, now))
+                continue; // Offers and expired bindings are no leases
+
+            if (count == LEASETABLE_CAPACITY) {
+                ++dropped;
+                continue;
+            }
+
+            struct leasetable_entry *e = &lease_table->entries[count++];
+            memcpy(e->netns, iface->name, netns_len);
+            e->netns[netns_len] = 0;
+            memcpy(e->ifname, iface->ifname, sizeof(e->ifname));
+            e->iaid = ntohl(c->iaid);
+            e->valid_until = c->valid_until - now + wall_time;
+            e->assigned = c->assigned;
+            e->length = c->length;
+            e->clid_len = c->clid_len;
+            memcpy(e->clid, c->clid_data, c->clid_len);
+            memcpy(e->hostname, c->hostname, sizeof(e->hostname));
+
+            e->addr_cnt = 0;
+            for (size_t j = 0; j < iface->pd_addr_len &&
+                    e->addr_cnt < LEASETABLE_MAX_ADDRS; ++j) {
+                if (iface->pd_addr[j].prefix > 64)
+                    continue;
+
+                struct in6_addr *addr = &e->addr[e->addr_cnt++];
+                *addr = iface->pd_addr[j].addr;
+                if (c->length == 128)
+                    addr->s6_addr32[3] = htonl(c->assigned);
+                else
+                    addr->s6_addr32[1] |= htonl(c->assigned);
+            }
+        }
+    }
+
+    lease_table->count = count;
+    lease_table->dropped = dropped;
+    lease_table->updated = wall_time;
+    __atomic_store_n(&lease_table->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
 
 static void write_statefile(void)
 {
+    if (lease_table)
+        publish_lease_table();
+
     if (config->dhcpv6_statefile) {
         time_t now = monotonic_time(), wall_time = time(NULL);
         int fd = open(config->dhcpv6_statefile, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
@@ -228,43 +947,16 @@ static void write_statefile(void)
                 if (c->clid_len == 0)
                     continue;
 
-                char ipbuf[INET6_ADDRSTRLEN];
-                char leasebuf[512];
-                char duidbuf[264];
-                const char hex[] = "0123456789abcdef";
-
-                for (size_t i = 0; i < c->clid_len; ++i) {
-                    duidbuf[2 * i] = hex[(c->clid_data[i] >> 4) & 0x0f];
-                    duidbuf[2 * i + 1] = hex[c->clid_data[i] & 0x0f];
+                char leasebuf[1024];
+                if (c->length == 128 && c->hostname[0] && iface->pd_addr_len > 0 &&
+                        iface->pd_addr[0].prefix <= 64) {
+                    struct in6_addr addr = iface->pd_addr[0].addr;
+                    addr.s6_addr32[3] = htonl(c->assigned);
+                    inet_ntop(AF_INET6, &addr, leasebuf, sizeof(leasebuf));
+                    fprintf(fp, "%s\t%s\n", leasebuf, c->hostname);
                 }
-                duidbuf[c->clid_len * 2] = 0;
-
-                // iface DUID iaid hostname lifetime assigned length [addrs...]
-                int l = snprintf(leasebuf, sizeof(leasebuf), "# %s %s %x %s %u %x %u ",
-                        iface->ifname, duidbuf, ntohl(c->iaid),
-                        (c->hostname ? c->hostname : "-"),
-                        (unsigned)(c->valid_until > now ?
-                                (c->valid_until - now + wall_time) : 0),
-                        c->assigned, (unsigned)c->length);
-
-                struct in6_addr addr;
-                for (size_t i = 0; i < iface->pd_addr_len; ++i) {
-                    if (iface->pd_addr[i].prefix > 64)
-                        continue;
 
-                    addr = iface->pd_addr[i].addr;
-                    if (c->length == 128)
-                        addr.s6_addr32[3] = htonl(c->assigned);
-                    else
-                        addr.s6_addr32[1] |= htonl(c->assigned);
-                    inet_ntop(AF_INET6, &addr, ipbuf, sizeof(ipbuf) - 1);
-
-                    if (c->length == 128 && c->hostname && i == 0)
-                        fprintf(fp, "%s\t%s\n", ipbuf, c->hostname);
-
-                    l += snprintf(leasebuf + l, sizeof(leasebuf) - l, "%s/%hhu ", ipbuf, c->length);
-                }
-                leasebuf[l - 1] = '\n';
+                size_t l = format_lease(leasebuf, sizeof(leasebuf), iface, c, now, wall_time);
                 fwrite(leasebuf, 1, l, fp);
             }
         }
@@ -290,11 +982,29 @@ static void apply_lease(struct relayd_interface *iface, struct assignment *a, bo
     for (size_t i = 0; i < iface->pd_addr_len; ++i) {
         struct in6_addr prefix = iface->pd_addr[i].addr;
         prefix.s6_addr32[1] |= htonl(a->assigned);
-        relayd_setup_route(&prefix, a->length, iface, &a->peer.sin6_addr, add);
+        relayd_setup_route(&prefix, a->length, iface, &a->peer.sin6_addr, 0, add);
     }
 }
 
 
+// Let the NDP proxy know on which interface leased addresses live
+static void announce_lease(struct relayd_interface *iface, struct assignment *a, bool add)
+{
+    if (a->length != 128 || a->neighbor == add)
+        return;
+
+    for (size_t i = 0; i < iface->pd_addr_len; ++i) {
+        if (iface->pd_addr[i].prefix > 64)
+            continue;
+
+        struct in6_addr addr = iface->pd_addr[i].addr;
+        addr.s6_addr32[3] = htonl(a->assigned);
+        ndp_learn_lease(&addr, iface, add);
+    }
+    a->neighbor = add;
+}
+
+
 static bool assign_pd(struct relayd_interface *iface, struct assignment *assign)
 {
     struct assignment *c;
@@ -310,6 +1020,7 @@ static bool assign_pd(struct relayd_interface *iface, struct assignment *assign)
 
             if (assign->assigned >= current && assign->assigned + asize < c->assigned) {
                 list_add_tail(&assign->head, &c->head);
+                index_binding(iface, assign);
                 apply_lease(iface, assign, true);
                 return true;
             }
@@ -329,6 +1040,7 @@ static bool assign_pd(struct relayd_interface *iface, struct assignment *assign)
         if (current + asize < c->assigned) {
             assign->assigned = current;
             list_add_tail(&assign->head, &c->head);
+            index_binding(iface, assign);
             apply_lease(iface, assign, true);
             return true;
         }
@@ -341,11 +1053,37 @@ static bool assign_pd(struct relayd_interface *iface, struct assignment *assign)
 }
 
 
+// Insert an IA_NA with the given number unless it is already taken
+static bool insert_na(struct relayd_interface *iface, struct assignment *assign,
+        uint32_t try)
+{
+    struct assignment *c;
+    list_for_each_entry(c, &iface->pd_assignments, head) {
+        if (c->assigned > try || c->length != 128) {
+            assign->assigned = try;
+            list_add_tail(&assign->head, &c->head);
+            index_binding(iface, assign);
+            return true;
+        } else if (c->assigned == try) {
+            break;
+        }
+    }
+
+    return false;
+}
+
+
 static bool assign_na(struct relayd_interface *iface, struct assignment *assign)
 {
     if (iface->pd_addr_len < 1)
         return false;
 
+    // Honor a static reservation
+    const struct static_lease *l = find_static_lease(assign->clid_data,
+            assign->clid_len, assign->clid_hash);
+    if (l && insert_na(iface, assign, l->assigned))
+        return true;
+
     // Seed RNG with checksum of DUID
     uint32_t seed = 0;
     for (size_t i = 0; i < assign->clid_len; ++i)
@@ -357,16 +1095,8 @@ static bool assign_na(struct relayd_interface *iface, struct assignment *assign)
         uint32_t try;
         do try = ((uint32_t)rand()) % 0x0fff; while (try < 0x100);
 
-        struct assignment *c;
-        list_for_each_entry(c, &iface->pd_assignments, head) {
-            if (c->assigned > try || c->length != 128) {
-                assign->assigned = try;
-                list_add_tail(&assign->head, &c->head);
-                return true;
-            } else if (c->assigned == try) {
-                break;
-            }
-        }
+        if (!is_static_assigned(try) && insert_na(iface, assign, try))
+            return true;
     }
 
     return false;
@@ -386,7 +1116,7 @@ static void update(struct relayd_interface *iface)
 {
     struct relayd_ipaddr addr[8];
     memset(addr, 0, sizeof(addr));
-    int len = relayd_get_interface_addresses(iface->ifindex, addr, 8);
+    int len = relayd_get_interface_addresses(iface, addr, 8);
 
     if (len < 0)
         return;
@@ -424,9 +1154,12 @@ static void update(struct relayd_interface *iface)
 
     if (change) {
         struct assignment *c;
-        list_for_each_entry(c, &iface->pd_assignments, head)
-            if (c != border)
+        list_for_each_entry(c, &iface->pd_assignments, head) {
+            if (c != border) {
                 apply_lease(iface, c, false);
+                announce_lease(iface, c, false);
+            }
+        }
     }
 
     memcpy(iface->pd_addr, addr, len * sizeof(*addr));
@@ -439,10 +1172,14 @@ static void update(struct relayd_interface *iface)
             if (c->clid_len == 0 || c->valid_until < now)
                 continue;
 
-            if (c->length < 128 && c->assigned >= border->assigned && c != border)
+            if (c->length < 128 && c->assigned >= border->assigned && c != border) {
+                unindex_binding(c);
                 list_move(&c->head, &reassign);
-            else if (c != border)
+            }
+            else if (c != border) {
                 apply_lease(iface, c, true);
+                announce_lease(iface, c, true);
+            }
 
             if (c->accept_reconf && c->reconf_cnt == 0) {
                 c->reconf_cnt = 1;
@@ -486,14 +1223,17 @@ static void reconf_timer(struct relayd_event *event)
             return;
 
         struct assignment *a, *n;
+        size_t bindings = 0;
         list_for_each_entry_safe(a, n, &iface->pd_assignments, head) {
+            if (a->valid_until >= now && a->clid_len > 0 && !a->tentative)
+                ++bindings;
+
             if (a->valid_until < now) {
+                announce_lease(iface, a, false);
                 if ((a->length < 128 && a->clid_len > 0) ||
-                        (a->length == 128 && a->clid_len == 0)) {
-                    list_del(&a->head);
-                    free(a->hostname);
-                    free(a);
-                }
+                        (a->length == 128 && a->clid_len == 0) ||
+                        a->tentative)
+                    free_assignment(a);
             } else if (a->reconf_cnt > 0 && a->reconf_cnt < 8 &&
                     now > a->reconf_sent + (1 << a->reconf_cnt)) {
                 ++a->reconf_cnt;
@@ -502,6 +1242,7 @@ static void reconf_timer(struct relayd_event *event)
             }
         }
 
+        policy_for(iface)->bindings = bindings;
         if (iface->pd_reconf) {
             update(iface);
             iface->pd_reconf = false;
@@ -510,17 +1251,19 @@ static void reconf_timer(struct relayd_event *event)
 }
 
 
-static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
+// Append an IA to the reply, false if it doesn't fit completely
+static bool append_reply(struct dhcpv6_reply *reply, uint16_t status,
         const struct dhcpv6_ia_hdr *ia, struct assignment *a,
         struct relayd_interface *iface, bool request)
 {
-    if (buflen < sizeof(*ia) + sizeof(struct dhcpv6_ia_prefix))
-        return 0;
-
     struct dhcpv6_ia_hdr out = {ia->type, 0, ia->iaid, 0, 0};
-    size_t datalen = sizeof(out);
+    size_t start = reply->len;
+    uint8_t *buf = dhcpv6_reply_reserve(reply, sizeof(out));
     time_t now = monotonic_time();
 
+    if (!buf)
+        return false;
+
     if (status) {
         struct __attribute__((packed)) {
             uint16_t type;
@@ -529,12 +1272,14 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
         } stat = {htons(DHCPV6_OPT_STATUS), htons(sizeof(stat) - 4),
                 htons(status)};
 
-        memcpy(buf + datalen, &stat, sizeof(stat));
-        datalen += sizeof(stat);
+        if (!dhcpv6_reply_append_copy(reply, &stat, sizeof(stat)))
+            return false;
     } else {
         if (a) {
-            uint32_t pref = 3600;
-            uint32_t valid = 3600;
+            uint32_t lifetime = policy_lifetime(iface);
+            uint32_t maxlife = (lifetime > DHCPV6_LIFETIME_CAP) ? lifetime : DHCPV6_LIFETIME_CAP;
+            uint32_t pref = lifetime;
+            uint32_t valid = lifetime;
             bool have_non_ula = false;
             for (size_t i = 0; i < iface->pd_addr_len; ++i)
                 if ((iface->pd_addr[i].addr.s6_addr[0] & 0xfe) != 0xfc)
@@ -554,11 +1299,11 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
                         config->deprecate_ula_if_public_avail)
                     continue;
 
-                if (prefix_pref > 86400)
-                    prefix_pref = 86400;
+                if (prefix_pref > maxlife)
+                    prefix_pref = maxlife;
 
-                if (prefix_valid > 86400)
-                    prefix_valid = 86400;
+                if (prefix_valid > maxlife)
+                    prefix_valid = maxlife;
 
                 if (a->length < 128) {
                     struct dhcpv6_ia_prefix p = {
@@ -571,11 +1316,11 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
                     };
                     p.addr.s6_addr32[1] |= htonl(a->assigned);
 
-                    if (datalen + sizeof(p) > buflen || a->assigned == 0)
+                    if (a->assigned == 0)
                         continue;
 
-                    memcpy(buf + datalen, &p, sizeof(p));
-                    datalen += sizeof(p);
+                    if (!dhcpv6_reply_append_copy(reply, &p, sizeof(p)))
+                        return false;
                 } else {
                     struct dhcpv6_ia_addr n = {
                         .type = htons(DHCPV6_OPT_IA_ADDR),
@@ -586,11 +1331,11 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
                     };
                     n.addr.s6_addr32[3] = htonl(a->assigned);
 
-                    if (datalen + sizeof(n) > buflen || a->assigned == 0)
+                    if (a->assigned == 0)
                         continue;
 
-                    memcpy(buf + datalen, &n, sizeof(n));
-                    datalen += sizeof(n);
+                    if (!dhcpv6_reply_append_copy(reply, &n, sizeof(n)))
+                        return false;
                 }
 
                 // Calculate T1 / T2 based on non-deprecated addresses
@@ -604,8 +1349,10 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
             }
 
             a->valid_until = valid + now;
-            out.t1 = htonl(pref * 5 / 10);
-            out.t2 = htonl(pref * 8 / 10);
+            // Spread renewals with T1 within 40-50% and T2 within 70-80%
+            uint32_t spread = jitter(pref / 10);
+            out.t1 = htonl(pref / 10 * 4 + spread);
+            out.t2 = htonl(pref / 10 * 7 + spread);
 
             if (!out.t1)
                 out.t1 = htonl(1);
@@ -635,13 +1382,13 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
                         if (ia->type == htons(DHCPV6_OPT_IA_PD)) {
                             addr.s6_addr32[1] |= htonl(a->assigned);
 
-                            if (IN6_ARE_ADDR_EQUAL(&p->addr, &addr) &&
+                            if (!memcmp(&p->addr, &addr, sizeof(addr)) &&
                                     p->prefix == a->length)
                                 found = true;
                         } else {
                             addr.s6_addr32[3] = htonl(a->assigned);
 
-                            if (IN6_ARE_ADDR_EQUAL(&n->addr, &addr))
+                            if (!memcmp(&n->addr, &addr, sizeof(addr)))
                                 found = true;
                         }
                     }
@@ -658,11 +1405,8 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
                             .addr = p->addr
                         };
 
-                        if (datalen + sizeof(inv) > buflen)
-                            continue;
-
-                        memcpy(buf + datalen, &inv, sizeof(inv));
-                        datalen += sizeof(inv);
+                        if (!dhcpv6_reply_append_copy(reply, &inv, sizeof(inv)))
+                            return false;
                     } else {
                         struct dhcpv6_ia_addr inv = {
                             .type = htons(DHCPV6_OPT_IA_ADDR),
@@ -672,86 +1416,117 @@ static size_t append_reply(uint8_t *buf, size_t buflen, uint16_t status,
                             .valid = 0
                         };
 
-                        if (datalen + sizeof(inv) > buflen)
-                            continue;
-
-                        memcpy(buf + datalen, &inv, sizeof(inv));
-                        datalen += sizeof(inv);
+                        if (!dhcpv6_reply_append_copy(reply, &inv, sizeof(inv)))
+                            return false;
                     }
                 }
             }
         }
     }
 
-    out.len = htons(datalen - 4);
+    out.len = htons(reply->len - start - 4);
     memcpy(buf, &out, sizeof(out));
-    return datalen;
+    return true;
+}
+
+
+// Append an IA or, if it would exceed the reply size, an IA carrying only
+// an error status: NoBinding for renewals so that the client restarts with
+// a SOLICIT. Returns the status sent or -1 if not even that fits.
+static int append_ia(struct dhcpv6_reply *reply, uint16_t status,
+        const struct dhcpv6_ia_hdr *ia, struct assignment *a,
+        struct relayd_interface *iface, bool request)
+{
+    struct dhcpv6_reply saved = *reply;
+    if (append_reply(reply, status, ia, a, iface, request))
+        return status;
+
+    *reply = saved;
+    if (status == DHCPV6_STATUS_OK) {
+        if (!request)
+            status = DHCPV6_STATUS_NOBINDING;
+        else if (ia->type == htons(DHCPV6_OPT_IA_PD))
+            status = DHCPV6_STATUS_NOPREFIXAVAIL;
+        else
+            status = DHCPV6_STATUS_NOADDRSAVAIL;
+        syslog(LOG_WARNING, "IA %x does not fit into reply on %s",
+                ntohl(ia->iaid), iface->ifname);
+
+        if (append_reply(reply, status, ia, NULL, iface, true))
+            return status;
+    }
+
+    *reply = saved;
+    return -1;
 }
 
 
-size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *iface,
-        const struct sockaddr_in6 *addr, const void *data, const uint8_t *end)
+ssize_t dhcpv6_handle_ia(struct dhcpv6_reply *reply, struct relayd_interface *iface,
+        const struct sockaddr_in6 *addr, const struct dhcpv6_msg *msg)
 {
     time_t now = monotonic_time();
-    size_t response_len = 0;
-    const struct dhcpv6_client_header *hdr = data;
-    uint8_t *start = (uint8_t*)&hdr[1], *odata;
-    uint16_t otype, olen;
+    size_t reply_start = reply->len;
+    const struct dhcpv6_client_header *hdr = msg->hdr;
+    const struct dhcpv6_option *o;
 
     // Find and parse client-id and hostname
-    bool accept_reconf = false;
+    bool accept_reconf = !!dhcpv6_msg_option(msg, DHCPV6_OPT_RECONF_ACCEPT);
     uint8_t *clid_data = NULL, clid_len = 0;
     char hostname[256];
     size_t hostname_len = 0;
-    dhcpv6_for_each_option(start, end, otype, olen, odata) {
-        if (otype == DHCPV6_OPT_CLIENTID) {
-            clid_data = odata;
-            clid_len = olen;
-        } else if (otype == DHCPV6_OPT_FQDN && olen >= 2 && olen <= 255) {
-            uint8_t fqdn_buf[256];
-            memcpy(fqdn_buf, odata, olen);
-            fqdn_buf[olen++] = 0;
 
-            if (dn_expand(&fqdn_buf[1], &fqdn_buf[olen], &fqdn_buf[1], hostname, sizeof(hostname)) > 0)
-                hostname_len = strcspn(hostname, ".");
-        } else if (otype == DHCPV6_OPT_RECONF_ACCEPT) {
-            accept_reconf = true;
-        }
+    if ((o = dhcpv6_msg_option(msg, DHCPV6_OPT_CLIENTID)) && o->len <= 130) {
+        clid_data = o->data;
+        clid_len = o->len;
     }
 
-    if (!clid_data || !clid_len || clid_len > 130)
+    if ((o = dhcpv6_msg_option(msg, DHCPV6_OPT_FQDN)) && o->len >= 2 && o->len <= 255) {
+        uint8_t fqdn_buf[256];
+        size_t fqdn_len = o->len;
+        memcpy(fqdn_buf, o->data, fqdn_len);
+        fqdn_buf[fqdn_len++] = 0;
+
+        if (dn_expand(&fqdn_buf[1], &fqdn_buf[fqdn_len], &fqdn_buf[1], hostname, sizeof(hostname)) > 0)
+            hostname_len = strcspn(hostname, ".");
+    }
+
+    if (!clid_data || !clid_len)
         goto out;
 
+    uint32_t hash = clid_hash(clid_data, clid_len);
+
     update(iface);
-    bool update_state = false;
+    if (hdr->msg_type == DHCPV6_MSG_RENEW || hdr->msg_type == DHCPV6_MSG_REBIND)
+        account_renew(iface, now);
+
+    bool update_state = false, overflow = false;
+
+    // REQUEST bindings are only committed once the whole reply fits
+    struct {
+        struct assignment *a;
+        time_t valid_until;
+        bool created;
+    } commit[DHCPV6_MAX_IA];
+    size_t commit_cnt = 0;
 
     struct assignment *first = NULL;
-    dhcpv6_for_each_option(start, end, otype, olen, odata) {
-        bool is_pd = (otype == DHCPV6_OPT_IA_PD);
-        bool is_na = (otype == DHCPV6_OPT_IA_NA);
-        if (!is_pd && !is_na)
-            continue;
+    for (size_t i = 0; i < msg->ia_cnt; ++i) {
+        struct dhcpv6_ia_hdr *ia = msg->ia[i].ia;
+        bool is_pd = (ia->type == htons(DHCPV6_OPT_IA_PD));
+        bool is_na = !is_pd;
 
-        struct dhcpv6_ia_hdr *ia = (struct dhcpv6_ia_hdr*)&odata[-4];
-        size_t ia_response_len = 0;
+        int ia_status = 0;
         uint8_t reqlen = (is_pd) ? 62 : 128;
         uint32_t reqhint = 0;
 
         // Parse request hint for IA-PD
         if (is_pd) {
-            uint8_t *sdata;
-            uint16_t stype, slen;
-            dhcpv6_for_each_option(&ia[1], odata + olen, stype, slen, sdata) {
-                if (stype == DHCPV6_OPT_IA_PREFIX && slen >= sizeof(struct dhcpv6_ia_prefix) - 4) {
-                    struct dhcpv6_ia_prefix *p = (struct dhcpv6_ia_prefix*)&sdata[-4];
-                    if (p->prefix) {
-                        reqlen = p->prefix;
-                        reqhint = ntohl(p->addr.s6_addr32[1]);
-                        if (reqlen > 32 && reqlen <= 64)
-                            reqhint &= (1U << (64 - reqlen)) - 1;
-                    }
-                    break;
-                }
+            const struct dhcpv6_ia_prefix *p = msg->ia[i].hint;
+            if (p && p->prefix) {
+                reqlen = p->prefix;
+                reqhint = ntohl(p->addr.s6_addr32[1]);
+                if (reqlen > 32 && reqlen <= 64)
+                    reqhint &= (1U << (64 - reqlen)) - 1;
             }
 
             if (reqlen > 64)
@@ -760,16 +1535,20 @@ size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *if
 
         // Find assignment
         struct assignment *c, *a = NULL;
+        time_t prior_valid = 0;
         list_for_each_entry(c, &iface->pd_assignments, head) {
-            if (c->clid_len == clid_len && !memcmp(c->clid_data, clid_data, clid_len) &&
+            if (c->clid_hash == hash && c->clid_len == clid_len &&
+                    !memcmp(c->clid_data, clid_data, clid_len) &&
                     (c->iaid == ia->iaid || c->valid_until < now) &&
                     ((is_pd && c->length <= 64) || (is_na && c->length == 128))) {
                 a = c;
+                prior_valid = a->valid_until;
 
                 // Reset state
                 apply_lease(iface, a, false);
                 a->iaid = ia->iaid;
                 a->peer = *addr;
+                a->last_seen = now;
                 a->reconf_cnt = 0;
                 a->reconf_sent = 0;
                 break;
@@ -779,14 +1558,33 @@ size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *if
         // Generic message handling
         uint16_t status = DHCPV6_STATUS_OK;
         if (hdr->msg_type == DHCPV6_MSG_SOLICIT || hdr->msg_type == DHCPV6_MSG_REQUEST) {
-            bool assigned = !!a;
+            bool assigned = !!a, created = !a;
+
+            // Make room in the tentative pool by dropping the oldest entry
+            // of another client, or refuse the new binding
+            bool room = true;
+            if (!a && hdr->msg_type == DHCPV6_MSG_SOLICIT &&
+                    tentative_cnt >= DHCPV6_MAX_TENTATIVE) {
+                struct assignment *old;
+                room = false;
+                list_for_each_entry(old, &tentatives, tentative_head) {
+                    if (old->clid_hash != hash || old->clid_len != clid_len ||
+                            memcmp(old->clid_data, clid_data, clid_len)) {
+                        free_assignment(old);
+                        ++tentative_evicted;
+                        room = true;
+                        break;
+                    }
+                }
+            }
 
-            if (!a) { // Create new binding
-                a = calloc(1, sizeof(*a) + clid_len);
+            if (!a && room && (a = alloc_assignment(clid_len))) { // Create new binding
                 a->clid_len = clid_len;
+                a->clid_hash = hash;
                 a->iaid = ia->iaid;
                 a->length = reqlen;
                 a->peer = *addr;
+                a->last_seen = now;
                 a->assigned = reqhint;
                 if (first)
                     memcpy(a->key, first->key, sizeof(a->key));
@@ -803,11 +1601,9 @@ size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *if
             if (!assigned || iface->pd_addr_len == 0) { // Set error status
                 status = (is_pd) ? DHCPV6_STATUS_NOPREFIXAVAIL : DHCPV6_STATUS_NOADDRSAVAIL;
             } else if (assigned && !first) { //
-                size_t handshake_len = 4;
-                buf[0] = 0;
-                buf[1] = DHCPV6_OPT_RECONF_ACCEPT;
-                buf[2] = 0;
-                buf[3] = 0;
+                const uint8_t reconf_accept[] = {0, DHCPV6_OPT_RECONF_ACCEPT, 0, 0};
+                if (!dhcpv6_reply_append_copy(reply, reconf_accept, sizeof(reconf_accept)))
+                    ia_status = -1;
 
                 if (hdr->msg_type == DHCPV6_MSG_REQUEST) {
                     struct dhcpv6_auth_reconfigure auth = {
@@ -819,34 +1615,28 @@ size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *if
                         {0}
                     };
                     memcpy(auth.key, a->key, sizeof(a->key));
-                    memcpy(buf + handshake_len, &auth, sizeof(auth));
-                    handshake_len += sizeof(auth);
+                    if (!dhcpv6_reply_append_copy(reply, &auth, sizeof(auth)))
+                        ia_status = -1;
                 }
 
-                buf += handshake_len;
-                buflen -= handshake_len;
-                response_len += handshake_len;
-
                 first = a;
             }
 
-            ia_response_len = append_reply(buf, buflen, status, ia, a, iface, true);
+            if (ia_status == 0)
+                ia_status = append_ia(reply, status, ia, a, iface, true);
 
-            // Was only a solicitation: mark binding for removal
-            if (assigned && hdr->msg_type == DHCPV6_MSG_SOLICIT) {
+            // Was only a solicitation or the reply was too large to carry
+            // the binding: mark binding for removal
+            if (assigned && (hdr->msg_type == DHCPV6_MSG_SOLICIT || ia_status != status)) {
                 a->valid_until = 0;
+                if (created)
+                    set_tentative(a, true);
             } else if (assigned && hdr->msg_type == DHCPV6_MSG_REQUEST) {
-                if (hostname_len > 0) {
-                    a->hostname = realloc(a->hostname, hostname_len + 1);
-                    memcpy(a->hostname, hostname, hostname_len);
-                    a->hostname[hostname_len] = 0;
-                }
-                a->accept_reconf = accept_reconf;
-                apply_lease(iface, a, true);
-                update_state = true;
+                commit[commit_cnt].a = a;
+                commit[commit_cnt].valid_until = prior_valid;
+                commit[commit_cnt++].created = created;
             } else if (!assigned && a) { // Cleanup failed assignment
-                free(a->hostname);
-                free(a);
+                release_assignment(a);
             }
         } else if (hdr->msg_type == DHCPV6_MSG_RENEW ||
                 hdr->msg_type == DHCPV6_MSG_RELEASE ||
@@ -854,17 +1644,21 @@ size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *if
                 hdr->msg_type == DHCPV6_MSG_DECLINE) {
             if (!a && hdr->msg_type != DHCPV6_MSG_REBIND) {
                 status = DHCPV6_STATUS_NOBINDING;
-                ia_response_len = append_reply(buf, buflen, status, ia, a, iface, false);
+                ia_status = append_ia(reply, status, ia, a, iface, false);
             } else if (hdr->msg_type == DHCPV6_MSG_RENEW ||
                     hdr->msg_type == DHCPV6_MSG_REBIND) {
-                ia_response_len = append_reply(buf, buflen, status, ia, a, iface, false);
-                if (a)
+                ia_status = append_ia(reply, status, ia, a, iface, false);
+                if (a) {
                     apply_lease(iface, a, true);
+                    announce_lease(iface, a, ia_status == status);
+                }
             } else if (hdr->msg_type == DHCPV6_MSG_RELEASE) {
                 a->valid_until = 0;
                 apply_lease(iface, a, false);
+                announce_lease(iface, a, false);
                 update_state = true;
             } else if (hdr->msg_type == DHCPV6_MSG_DECLINE && a->length == 128) {
+                announce_lease(iface, a, false);
                 a->clid_len = 0;
                 a->valid_until = now + 3600; // Block address for 1h
                 update_state = true;
@@ -872,27 +1666,252 @@ size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *if
         } else if (hdr->msg_type == DHCPV6_MSG_CONFIRM) {
             // Always send NOTONLINK for CONFIRM so that clients restart connection
             status = DHCPV6_STATUS_NOTONLINK;
-            ia_response_len = append_reply(buf, buflen, status, ia, a, iface, true);
+            ia_status = append_ia(reply, status, ia, a, iface, true);
         }
 
-        buf += ia_response_len;
-        buflen -= ia_response_len;
-        response_len += ia_response_len;
+        if (ia_status < 0)
+            overflow = true;
     }
 
-    if (hdr->msg_type == DHCPV6_MSG_RELEASE && response_len + 6 < buflen) {
-        buf[0] = 0;
-        buf[1] = DHCPV6_OPT_STATUS;
-        buf[2] = 0;
-        buf[3] = 2;
-        buf[4] = 0;
-        buf[5] = DHCPV6_STATUS_OK;
-        response_len += 6;
+    if (hdr->msg_type == DHCPV6_MSG_RELEASE) {
+        const uint8_t release_ok[] = {0, DHCPV6_OPT_STATUS, 0, 2, 0, DHCPV6_STATUS_OK};
+        if (!dhcpv6_reply_append_copy(reply, release_ok, sizeof(release_ok)))
+            overflow = true;
+    }
+
+    for (size_t i = 0; i < commit_cnt; ++i) {
+        struct assignment *a = commit[i].a;
+        if (overflow) { // Client never sees the reply: roll back
+            a->valid_until = (commit[i].created) ? 0 : commit[i].valid_until;
+            if (commit[i].created)
+                set_tentative(a, true);
+            else if (a->valid_until >= now)
+                apply_lease(iface, a, true);
+            continue;
+        }
+
+        set_tentative(a, false);
+        if (hostname_len > 0 && hostname_len < sizeof(a->hostname)) {
+            memcpy(a->hostname, hostname, hostname_len);
+            a->hostname[hostname_len] = 0;
+        }
+        a->accept_reconf = accept_reconf;
+        apply_lease(iface, a, true);
+        announce_lease(iface, a, true);
+        update_state = true;
     }
 
     if (update_state)
         write_statefile();
 
+    if (overflow)
+        return -1;
+
 out:
-    return response_len;
+    return reply->len - reply_start;
+}
+
+
+// Append OPTION_CLIENT_DATA describing the bindings of one client
+static bool append_client_data(struct dhcpv6_reply *reply,
+        struct assignment **bindings, size_t cnt, time_t now)
+{
+    size_t start = reply->len;
+    uint8_t *buf = dhcpv6_reply_reserve(reply, 4);
+    const struct assignment *first = bindings[0];
+    uint16_t clid_hdr[2] = {htons(DHCPV6_OPT_CLIENTID), htons(first->clid_len)};
+    time_t last_seen = 0;
+
+    if (!buf || !dhcpv6_reply_append_copy(reply, clid_hdr, sizeof(clid_hdr)) ||
+            !dhcpv6_reply_append_copy(reply, first->clid_data, first->clid_len))
+        return false;
+
+    for (size_t i = 0; i < cnt; ++i) {
+        const struct assignment *a = bindings[i];
+        const struct relayd_interface *iface = a->iface;
+        uint32_t valid = (a->valid_until > now) ? a->valid_until - now : 0;
+
+        if (a->last_seen > last_seen)
+            last_seen = a->last_seen;
+
+        for (size_t j = 0; j < iface->pd_addr_len; ++j) {
+            const struct relayd_ipaddr *p = &iface->pd_addr[j];
+            uint32_t pref = (p->preferred > (uint32_t)now) ? p->preferred - now : 0;
+            if (p->prefix > 64)
+                continue;
+
+            if (pref > valid)
+                pref = valid;
+
+            if (a->length < 128) {
+                struct dhcpv6_ia_prefix o = {
+                    .type = htons(DHCPV6_OPT_IA_PREFIX),
+                    .len = htons(sizeof(o) - 4),
+                    .preferred = htonl(pref),
+                    .valid = htonl(valid),
+                    .prefix = a->length,
+                    .addr = p->addr
+                };
+                o.addr.s6_addr32[1] |= htonl(a->assigned);
+
+                if (!dhcpv6_reply_append_copy(reply, &o, sizeof(o)))
+                    return false;
+            } else {
+                struct dhcpv6_ia_addr o = {
+                    .type = htons(DHCPV6_OPT_IA_ADDR),
+                    .len = htons(sizeof(o) - 4),
+                    .addr = p->addr,
+                    .preferred = htonl(pref),
+                    .valid = htonl(valid)
+                };
+                o.addr.s6_addr32[3] = htonl(a->assigned);
+
+                if (!dhcpv6_reply_append_copy(reply, &o, sizeof(o)))
+                    return false;
+            }
+        }
+    }
+
+    struct __attribute__((packed)) {
+        uint16_t type;
+        uint16_t len;
+        uint32_t value;
+    } clt_time = {htons(DHCPV6_OPT_CLT_TIME), htons(sizeof(uint32_t)),
+            htonl(now - last_seen)};
+
+    if (!dhcpv6_reply_append_copy(reply, &clt_time, sizeof(clt_time)))
+        return false;
+
+    uint16_t hdr[2] = {htons(DHCPV6_OPT_CLIENT_DATA), htons(reply->len - start - 4)};
+    memcpy(buf, hdr, sizeof(hdr));
+    return true;
+}
+
+
+// Answer an RFC 5007 query by address or by client identifier
+ssize_t dhcpv6_handle_leasequery(struct dhcpv6_reply *reply,
+        const struct relayd_interface *iface, const struct dhcpv6_msg *msg)
+{
+    size_t reply_start = reply->len;
+    const struct dhcpv6_option *o = dhcpv6_msg_option(msg, DHCPV6_OPT_LQ_QUERY);
+    uint16_t status = DHCPV6_STATUS_OK;
+    struct assignment *bindings[DHCPV6_MAX_IA];
+    size_t cnt = 0;
+    time_t now = monotonic_time();
+
+    if (!o || o->len < 17) {
+        status = DHCPV6_STATUS_MALFORMEDQUERY;
+    } else if (o->data[0] == DHCPV6_LQ_QUERY_BY_ADDRESS) {
+        const struct dhcpv6_ia_addr *n = NULL;
+        uint8_t *odata, *end = o->data + o->len;
+        uint16_t otype, olen;
+        dhcpv6_for_each_option(&o->data[17], end, otype, olen, odata)
+            if (otype == DHCPV6_OPT_IA_ADDR && olen >= sizeof(*n) - 4)
+                n = (struct dhcpv6_ia_addr*)&odata[-4];
+
+        struct in6_addr addr;
+        if (n)
+            memcpy(&addr, &n->addr, sizeof(addr));
+
+        if (!n)
+            status = DHCPV6_STATUS_MALFORMEDQUERY;
+        else if ((bindings[0] = find_binding(iface->netns, &addr)) &&
+                is_leased(bindings[0], now))
+            cnt = 1;
+    } else if (o->data[0] == DHCPV6_LQ_QUERY_BY_CLIENTID) {
+        uint8_t *clid_data = NULL, *odata, *end = o->data + o->len;
+        uint16_t otype, olen, clid_len = 0;
+        dhcpv6_for_each_option(&o->data[17], end, otype, olen, odata) {
+            if (otype == DHCPV6_OPT_CLIENTID && olen > 0 && olen <= 130) {
+                clid_data = odata;
+                clid_len = olen;
+            }
+        }
+
+        if (!clid_data) {
+            status = DHCPV6_STATUS_MALFORMEDQUERY;
+        } else {
+            uint32_t hash = clid_hash(clid_data, clid_len);
+            for (size_t i = 0; i < config->slavecount; ++i) {
+                struct assignment *c;
+                if (config->slaves[i].netns != iface->netns)
+                    continue;
+
+                list_for_each_entry(c, &config->slaves[i].pd_assignments, head)
+                    if (c->iface && cnt < DHCPV6_MAX_IA && is_leased(c, now) &&
+                            c->clid_hash == hash && c->clid_len == clid_len &&
+                            !memcmp(c->clid_data, clid_data, clid_len))
+                        bindings[cnt++] = c;
+            }
+        }
+    } else {
+        status = DHCPV6_STATUS_UNKNOWNQUERYTYPE;
+    }
+
+    if (status) {
+        struct __attribute__((packed)) {
+            uint16_t type;
+            uint16_t len;
+            uint16_t value;
+        } stat = {htons(DHCPV6_OPT_STATUS), htons(sizeof(stat) - 4),
+                htons(status)};
+
+        if (!dhcpv6_reply_append_copy(reply, &stat, sizeof(stat)))
+            return -1;
+    } else if (cnt > 0 && !append_client_data(reply, bindings, cnt, now)) {
+        return -1;
+    }
+
+    return reply->len - reply_start;
+}
+
+
+// Local queries: a datagram with an address or prefix is answered with
+// its lease line in statefile format or an empty datagram if unbound,
+// the first binding found in any namespace answers
+static void handle_query(struct relayd_event *event)
+{
+    for (size_t budget = RELAYD_EVENT_BUDGET; budget > 0; --budget) {
+        char buf[1024];
+        struct sockaddr_un peer;
+        socklen_t peer_len = sizeof(peer);
+        ssize_t len = recvfrom(event->socket, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+                (struct sockaddr*)&peer, &peer_len);
+        if (len < 0) {
+            if (errno == EAGAIN)
+                return;
+            else
+                continue;
+        }
+
+        buf[len] = 0;
+        buf[strcspn(buf, "/ \t\r\n")] = 0;
+
+        struct in6_addr addr;
+        struct assignment *a = NULL;
+        time_t now = monotonic_time();
+        if (inet_pton(AF_INET6, buf, &addr) == 1 &&
+                (a = find_binding(RELAYD_NETNS_ANY, &addr)) && !is_leased(a, now))
+            a = NULL;
+
+        len = (a) ? (ssize_t)format_lease(buf, sizeof(buf), a->iface, a,
+                now, time(NULL)) : 0;
+        sendto(event->socket, buf, len, MSG_DONTWAIT, (struct sockaddr*)&peer, peer_len);
+    }
+
+    // Budget exhausted, leave the loop to other events first
+    relayd_reschedule_event(event);
+}
+
+
+// Interface an address is leased on as IA_NA, NULL if not leased
+struct relayd_interface* dhcpv6_lookup_lease(size_t netns,
+        const struct in6_addr *addr)
+{
+    if (!config || !binding_index)
+        return NULL;
+
+    struct assignment *a = find_binding(netns, addr);
+    return (a && a->length == 128 && a->valid_until >= monotonic_time()) ?
+            a->iface : NULL;
 }
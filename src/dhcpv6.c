@@ -16,7 +16,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <resolv.h>
+#include <arpa/inet.h>
 #include <sys/timerfd.h>
 
 #include "6relayd.h"
@@ -25,20 +27,124 @@
 
 static void relay_client_request(struct sockaddr_in6 *source,
         const void *data, size_t len, struct relayd_interface *iface);
-static void relay_server_response(uint8_t *data, size_t len);
+static void relay_server_response(uint8_t *data, size_t len,
+        const struct sockaddr_in6 *source, size_t netns);
 
-static int create_socket(uint16_t port);
+static int create_socket(size_t first, size_t count);
 
 static void handle_dhcpv6(void *addr, void *data, size_t len,
         struct relayd_interface *iface);
 static void handle_client_request(void *addr, void *data, size_t len,
         struct relayd_interface *iface);
 
-static struct relayd_event dhcpv6_event = {-1, NULL, handle_dhcpv6};
+static struct relayd_event dhcpv6_event = {.socket = -1,
+        .handle_dgram = handle_dhcpv6, .priority = RELAYD_PRIO_NORMAL};
 
 static const struct relayd_config *config = NULL;
 
 
+// Relay statistics per server and per slave interface
+#define RELAY_LATENCY_BUCKETS 8 // <1, <4, <16, ... <4096 ms and above
+
+struct relay_stats {
+    uint32_t forwarded;
+    uint32_t replies;
+    uint32_t timeouts;
+    uint32_t duplicates;
+    uint32_t latency[RELAY_LATENCY_BUCKETS];
+};
+
+// Unicast relay destinations
+#define RELAY_SERVER_MAX_LOSS 3   // timed out transactions until failover
+#define RELAY_SERVER_HOLDDOWN 30000 // ms before retrying a failed server
+
+struct relay_server {
+    struct sockaddr_in6 addr;
+    uint64_t down_until;
+    uint32_t lost; // Consecutive timed out transactions
+    uint32_t srtt; // Smoothed response time in ms
+    struct relay_stats stats;
+};
+
+static struct relay_server *servers = NULL;
+static size_t server_cnt = 0;
+static struct relay_stats *slave_stats = NULL;
+
+// Leasequery requestors, queries from other sources are ignored
+static struct in6_addr *requestors = NULL;
+static size_t requestor_cnt = 0;
+
+// Forwarded requests awaiting a reply, 4-way set-associative
+#define RELAY_TRANSACTION_SETS 256
+#define RELAY_TRANSACTION_WAYS 4
+#define RELAY_TRANSACTION_TIMEOUT 2000 // ms
+
+struct relay_transaction {
+    struct in6_addr peer;
+    struct relayd_interface *iface;
+    uint8_t xid[3];
+    bool used;
+    uint64_t forwarded_at;
+    struct relay_server *server;
+};
+
+static struct relay_transaction transactions[RELAY_TRANSACTION_SETS]
+        [RELAY_TRANSACTION_WAYS];
+
+// Per-client admission control (GCRA token buckets), 4-way set-associative
+#define ADMISSION_SETS 256
+#define ADMISSION_WAYS 4
+#define ADMISSION_BURST 8 // Requests a client may send back-to-back
+#define ADMISSION_INTERVAL 2000 // ms to earn another request
+#define ADMISSION_NEW_BURST 64 // Unknown clients admitted back-to-back
+#define ADMISSION_NEW_INTERVAL 10 // ms to earn another unknown client
+
+struct admission_bucket {
+    uint32_t key;
+    bool used;
+    uint64_t tat; // Theoretical arrival time
+};
+
+static struct admission_bucket admission[ADMISSION_SETS][ADMISSION_WAYS];
+static uint32_t shed_source = 0;
+static uint32_t shed_duid = 0;
+static uint32_t shed_new = 0;
+static uint64_t admission_new_tat = 0;
+
+// Load shedding by receive queue fill in percent
+#define SHED_SOLICIT 50 // New clients first
+#define SHED_RELAY 75 // Then relaying to servers
+#define SHED_LOCAL 90 // Then all but maintenance of existing bindings
+
+static uint32_t shed_load = 0;
+static bool admit_request(const struct sockaddr_in6 *source, uint8_t type,
+        bool relayed, const struct dhcpv6_option *clientid);
+static bool is_requestor(const struct sockaddr_in6 *source,
+        const struct dhcpv6_msg *msg);
+static void expire_transactions(struct relayd_event *event);
+static struct relayd_event transaction_event = {.socket = -1,
+        .handle_event = expire_transactions, .priority = RELAYD_PRIO_HIGH};
+
+// Routes to prefixes delegated to relayed clients
+#define RELAY_PD_ROUTES 512
+
+struct relay_pd_route {
+    struct in6_addr prefix;
+    struct in6_addr peer;
+    struct relayd_interface *iface;
+    uint8_t length;
+    bool used;
+    uint64_t valid_until;
+};
+
+static struct relay_pd_route pd_routes[RELAY_PD_ROUTES];
+static size_t pd_route_cnt = 0;
+static uint32_t pd_route_learned = 0;
+static uint32_t pd_route_expired = 0;
+static uint32_t pd_route_dropped = 0;
+static void learn_pd_routes(struct relayd_interface *iface,
+        const struct in6_addr *peer, const struct dhcpv6_msg *msg, bool add);
+
 
 // Create socket and register events
 int init_dhcpv6_relay(const struct relayd_config *relayd_config)
@@ -48,40 +154,67 @@ int init_dhcpv6_relay(const struct relayd_config *relayd_config)
     if (!config->enable_dhcpv6_relay || config->slavecount < 1)
         return 0;
 
-    if ((dhcpv6_event.socket = create_socket(DHCPV6_SERVER_PORT)) < 0) {
+    // Shards are copies, so choose the handler before opening them
+    if (config->enable_dhcpv6_server)
+        dhcpv6_event.handle_dgram = handle_client_request;
+
+    // Unicasts reach a single one of the shard sockets sharing the port
+    if (relayd_open_shards(&dhcpv6_event, create_socket)) {
         syslog(LOG_ERR, "Failed to open DHCPv6 server socket: %s",
                 strerror(errno));
         return -1;
     }
 
-    dhcpv6_init_ia(relayd_config, dhcpv6_event.socket);
+    dhcpv6_init_ia(relayd_config, &dhcpv6_event);
 
+    if (config->dhcpv6_server_len > 0)
+        servers = calloc(config->dhcpv6_server_len, sizeof(*servers));
 
-    // Configure multicast settings
-    struct ipv6_mreq mreq = {ALL_DHCPV6_RELAYS, 0};
-    struct ipv6_mreq mreq2 = {ALL_DHCPV6_SERVERS, 0};
-    for (size_t i = 0; i < config->slavecount; ++i) {
-        mreq.ipv6mr_interface = config->slaves[i].ifindex;
-        setsockopt(dhcpv6_event.socket, IPPROTO_IPV6,
-                IPV6_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    slave_stats = calloc(config->slavecount, sizeof(*slave_stats));
 
-        if (config->enable_dhcpv6_server) {
-            mreq2.ipv6mr_interface = config->slaves[i].ifindex;
-            setsockopt(dhcpv6_event.socket, IPPROTO_IPV6,
-                    IPV6_ADD_MEMBERSHIP, &mreq2, sizeof(mreq2));
+    for (size_t i = 0; i < config->dhcpv6_server_len; ++i) {
+        struct relay_server *s = &servers[server_cnt++];
+        s->addr.sin6_family = AF_INET6;
+        s->addr.sin6_port = htons(DHCPV6_SERVER_PORT);
+        if (inet_pton(AF_INET6, config->dhcpv6_server[i], &s->addr.sin6_addr) != 1 ||
+                IN6_IS_ADDR_MULTICAST(&s->addr.sin6_addr)) {
+            syslog(LOG_ERR, "Invalid DHCPv6 server %s", config->dhcpv6_server[i]);
+            return -1;
         }
     }
 
-    if (config->enable_dhcpv6_server)
-        dhcpv6_event.handle_dgram = handle_client_request;
-    relayd_register_event(&dhcpv6_event);
+    if (config->dhcpv6_requestor_len > 0)
+        requestors = calloc(config->dhcpv6_requestor_len, sizeof(*requestors));
 
-    return 0;
+    for (size_t i = 0; i < config->dhcpv6_requestor_len; ++i) {
+        if (inet_pton(AF_INET6, config->dhcpv6_requestor[i],
+                &requestors[requestor_cnt++]) != 1) {
+            syslog(LOG_ERR, "Invalid leasequery requestor %s",
+                    config->dhcpv6_requestor[i]);
+            return -1;
+        }
+    }
+
+
+    if (!config->enable_dhcpv6_server) {
+        transaction_event.socket = timerfd_create(CLOCK_MONOTONIC,
+                TFD_CLOEXEC | TFD_NONBLOCK);
+        if (transaction_event.socket < 0) {
+            syslog(LOG_ERR, "Failed to create timer: %s", strerror(errno));
+            return -1;
+        }
+
+        struct itimerspec its = {{1, 0}, {1, 0}};
+        timerfd_settime(transaction_event.socket, 0, &its, NULL);
+        relayd_register_event(&transaction_event);
+    }
+
+    return relayd_register_shards(&dhcpv6_event);
 }
 
 
-// Create server socket
-static int create_socket(uint16_t port)
+// Create server socket for a range of slaves
+static int create_socket(size_t first, size_t count)
 {
     int sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
     if (sock < 0)
@@ -99,69 +232,248 @@ static int create_socket(uint16_t port)
     val = 0;
     setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &val, sizeof(val));
 
-    struct sockaddr_in6 bind_addr = {AF_INET6, htons(port),
+    struct sockaddr_in6 bind_addr = {AF_INET6, htons(DHCPV6_SERVER_PORT),
                 0, IN6ADDR_ANY_INIT, 0};
     if (bind(sock, (struct sockaddr*)&bind_addr, sizeof(bind_addr))) {
         close(sock);
         return -1;
     }
 
+    // Configure multicast settings
+    struct ipv6_mreq mreq = {ALL_DHCPV6_RELAYS, 0};
+    struct ipv6_mreq mreq2 = {ALL_DHCPV6_SERVERS, 0};
+    for (size_t i = first; i < first + count; ++i) {
+        mreq.ipv6mr_interface = config->slaves[i].ifindex;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP,
+                &mreq, sizeof(mreq));
+
+        if (config->enable_dhcpv6_server) {
+            mreq2.ipv6mr_interface = config->slaves[i].ifindex;
+            setsockopt(sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP,
+                    &mreq2, sizeof(mreq2));
+        }
+    }
+
     return sock;
 }
 
 
-static void handle_nested_message(uint8_t *data, size_t len,
-        uint8_t **opts, uint8_t **end, struct iovec iov[5])
+// Walk the options between start and end once and record them in the index
+static int index_options(struct dhcpv6_msg *msg, uint8_t *start, uint8_t *end)
+{
+    int last[DHCPV6_OPT_INDEXED];
+    memset(last, -1, sizeof(last));
+
+    for (uint8_t *o = start; o < end; ) {
+        if (o + 4 > end)
+            return -1; // Truncated option header
+
+        uint16_t otype = o[0] << 8 | o[1];
+        uint16_t olen = o[2] << 8 | o[3];
+        uint8_t *odata = &o[4];
+        if (odata + olen > end || msg->opt_cnt >= DHCPV6_MAX_OPTIONS)
+            return -1; // Truncated option or index exhausted
+
+        struct dhcpv6_option *opt = &msg->opt[msg->opt_cnt];
+        opt->type = otype;
+        opt->len = olen;
+        opt->data = odata;
+        opt->next = -1;
+
+        if (otype < DHCPV6_OPT_INDEXED) {
+            if (last[otype] < 0)
+                msg->first[otype] = msg->opt_cnt;
+            else
+                msg->opt[last[otype]].next = msg->opt_cnt;
+            last[otype] = msg->opt_cnt;
+        }
+        ++msg->opt_cnt;
+
+        if (otype == DHCPV6_OPT_IA_NA || otype == DHCPV6_OPT_IA_PD) {
+            if (olen < sizeof(struct dhcpv6_ia_hdr) - 4)
+                return -1;
+
+            if (msg->ia_cnt >= DHCPV6_MAX_IA)
+                return -1;
+
+            struct dhcpv6_ia_index *ia = &msg->ia[msg->ia_cnt++];
+            ia->ia = (struct dhcpv6_ia_hdr*)o;
+            ia->end = odata + olen;
+            ia->hint = NULL;
+
+            uint16_t stype, slen;
+            uint8_t *sdata;
+            dhcpv6_for_each_option(&ia->ia[1], ia->end, stype, slen, sdata) {
+                if (otype == DHCPV6_OPT_IA_PD && stype == DHCPV6_OPT_IA_PREFIX) {
+                    if (slen >= sizeof(struct dhcpv6_ia_prefix) - 4)
+                        ia->hint = (struct dhcpv6_ia_prefix*)&sdata[-4];
+                    break;
+                }
+            }
+        }
+
+        o = odata + olen;
+    }
+
+    return 0;
+}
+
+
+// Parse a (possibly relayed) DHCPv6 message into an option index
+int dhcpv6_parse_message(struct dhcpv6_msg *msg, uint8_t *data, size_t len)
 {
-    struct dhcpv6_relay_header *hdr = (struct dhcpv6_relay_header*)data;
-    if (iov[0].iov_base == NULL) {
-        iov[0].iov_base = data;
-        iov[0].iov_len = len;
+    msg->relay_cnt = 0;
+    msg->opt_cnt = 0;
+    msg->ia_cnt = 0;
+    memset(msg->first, -1, sizeof(msg->first));
+
+    // Unwrap relay layers
+    while (len >= sizeof(struct dhcpv6_client_header) &&
+            (data[0] == DHCPV6_MSG_RELAY_FORW ||
+            data[0] == DHCPV6_MSG_RELAY_REPL)) {
+        struct dhcpv6_relay_header *hdr = (void*)data;
+        if (len < sizeof(*hdr) || msg->relay_cnt >= ARRAY_SIZE(msg->relay))
+            return -1;
+
+        struct dhcpv6_relay_layer *r = &msg->relay[msg->relay_cnt++];
+        memset(r, 0, sizeof(*r));
+        r->hdr = hdr;
+
+        uint8_t *end = data + len;
+        for (uint8_t *o = hdr->options; o < end; ) {
+            if (o + 4 > end)
+                return -1;
+
+            uint16_t otype = o[0] << 8 | o[1];
+            uint16_t olen = o[2] << 8 | o[3];
+            if (&o[4] + olen > end)
+                return -1;
+
+            if (otype == DHCPV6_OPT_RELAY_MSG && !r->relay_msg) {
+                r->relay_msg = &o[4];
+                r->relay_msg_len = olen;
+            } else if (otype == DHCPV6_OPT_INTERFACE_ID && !r->interface_id) {
+                r->interface_id = &o[4];
+                r->interface_id_len = olen;
+            }
+
+            o += 4 + olen;
+        }
+
+        if (!r->relay_msg)
+            return -1;
+
+        data = r->relay_msg;
+        len = r->relay_msg_len;
     }
 
     if (len < sizeof(struct dhcpv6_client_header))
-        return;
+        return -1;
 
-    if (hdr->msg_type != DHCPV6_MSG_RELAY_FORW) {
-        iov[0].iov_len = data - (uint8_t*)iov[0].iov_base;
-        struct dhcpv6_client_header *hdr = (void*)data;
-        *opts = (uint8_t*)&hdr[1];
-        *end = data + len;
-        return;
+    msg->hdr = (struct dhcpv6_client_header*)data;
+    msg->end = data + len;
+    return index_options(msg, (uint8_t*)&msg->hdr[1], msg->end);
+}
+
+
+const struct dhcpv6_option* dhcpv6_msg_option(const struct dhcpv6_msg *msg,
+        uint16_t code)
+{
+    if (code < DHCPV6_OPT_INDEXED)
+        return (msg->first[code] >= 0) ? &msg->opt[msg->first[code]] : NULL;
+
+    for (size_t i = 0; i < msg->opt_cnt; ++i)
+        if (msg->opt[i].type == code)
+            return &msg->opt[i];
+
+    return NULL;
+}
+
+
+static uint8_t reply_segments[DHCPV6_REPLY_SEGMENTS][DHCPV6_REPLY_SEGMENT_SIZE];
+
+// Start a new reply limited to maxlen bytes
+void dhcpv6_reply_init(struct dhcpv6_reply *reply, size_t maxlen)
+{
+    reply->iov_cnt = 0;
+    reply->len = 0;
+    reply->maxlen = maxlen;
+    reply->seg = 0;
+    reply->seg_used = 0;
+}
+
+
+// Reference caller-owned data in the reply without copying it
+bool dhcpv6_reply_append(struct dhcpv6_reply *reply, const void *data, size_t len)
+{
+    if (len == 0)
+        return true;
+
+    if (reply->len + len > reply->maxlen || reply->iov_cnt >= DHCPV6_REPLY_IOV)
+        return false;
+
+    reply->iov[reply->iov_cnt].iov_base = (void*)data;
+    reply->iov[reply->iov_cnt++].iov_len = len;
+    reply->len += len;
+    return true;
+}
+
+
+// Reserve contiguous space from the segment chain, NULL if the reply is full
+void* dhcpv6_reply_reserve(struct dhcpv6_reply *reply, size_t len)
+{
+    if (len > DHCPV6_REPLY_SEGMENT_SIZE || reply->len + len > reply->maxlen)
+        return NULL;
+
+    if (reply->seg_used + len > DHCPV6_REPLY_SEGMENT_SIZE) {
+        if (reply->seg + 1 >= DHCPV6_REPLY_SEGMENTS)
+            return NULL;
+
+        ++reply->seg;
+        reply->seg_used = 0;
     }
 
-    uint16_t otype, olen;
-    uint8_t *odata;
-    dhcpv6_for_each_option(hdr->options, data + len, otype, olen, odata) {
-        if (otype == DHCPV6_OPT_RELAY_MSG) {
-            iov[5].iov_base = odata + olen;
-            iov[5].iov_len = (((uint8_t*)iov[0].iov_base) + iov[0].iov_len)
-                    - (odata + olen);
-            handle_nested_message(odata, olen, opts, end, iov);
-            return;
-        }
+    uint8_t *buf = &reply_segments[reply->seg][reply->seg_used];
+    struct iovec *last = (reply->iov_cnt > 0) ?
+            &reply->iov[reply->iov_cnt - 1] : NULL;
+
+    // Extend the last iovec if it ends right here
+    if (last && (uint8_t*)last->iov_base + last->iov_len == buf) {
+        last->iov_len += len;
+    } else {
+        if (reply->iov_cnt >= DHCPV6_REPLY_IOV)
+            return NULL;
+
+        reply->iov[reply->iov_cnt].iov_base = buf;
+        reply->iov[reply->iov_cnt++].iov_len = len;
     }
+
+    reply->seg_used += len;
+    reply->len += len;
+    return buf;
 }
 
 
-static void update_nested_message(uint8_t *data, size_t len, ssize_t pdiff)
+// Copy data into the segment chain
+bool dhcpv6_reply_append_copy(struct dhcpv6_reply *reply, const void *data, size_t len)
 {
-    struct dhcpv6_relay_header *hdr = (struct dhcpv6_relay_header*)data;
-    if (hdr->msg_type != DHCPV6_MSG_RELAY_FORW)
-        return;
+    void *buf = dhcpv6_reply_reserve(reply, len);
+    if (buf)
+        memcpy(buf, data, len);
+    return !!buf;
+}
 
-    hdr->msg_type = DHCPV6_MSG_RELAY_REPL;
 
-    uint16_t otype, olen;
-    uint8_t *odata;
-    dhcpv6_for_each_option(hdr->options, data + len, otype, olen, odata) {
-        if (otype == DHCPV6_OPT_RELAY_MSG) {
-            olen += pdiff;
-            odata[-2] = (olen >> 8) & 0xff;
-            odata[-1] = olen & 0xff;
-            update_nested_message(odata, olen - pdiff, pdiff);
-            return;
-        }
+// Turn relay-forward layers into relay-reply and fix up their lengths
+static void update_nested_message(const struct dhcpv6_msg *msg, ssize_t pdiff)
+{
+    for (size_t i = 0; i < msg->relay_cnt; ++i) {
+        const struct dhcpv6_relay_layer *r = &msg->relay[i];
+        uint16_t olen = r->relay_msg_len + pdiff;
+
+        r->hdr->msg_type = DHCPV6_MSG_RELAY_REPL;
+        r->relay_msg[-2] = (olen >> 8) & 0xff;
+        r->relay_msg[-1] = olen & 0xff;
     }
 }
 
@@ -170,8 +482,22 @@ static void update_nested_message(uint8_t *data, size_t len, ssize_t pdiff)
 static void handle_client_request(void *addr, void *data, size_t len,
         struct relayd_interface *iface)
 {
-    struct dhcpv6_client_header *hdr = data;
-    if (len < sizeof(*hdr))
+    struct dhcpv6_msg msg;
+    if (dhcpv6_parse_message(&msg, data, len))
+        return;
+
+    for (size_t i = 0; i < msg.relay_cnt; ++i)
+        if (msg.relay[i].hdr->msg_type != DHCPV6_MSG_RELAY_FORW)
+            return;
+
+    // Bindings are only disclosed to configured requestors
+    if (msg.hdr->msg_type == DHCPV6_MSG_LEASEQUERY && !is_requestor(addr, &msg)) {
+        syslog(LOG_NOTICE, "Ignoring leasequery from unknown requestor");
+        return;
+    }
+
+    if (!admit_request(addr, msg.hdr->msg_type, msg.relay_cnt > 0,
+            dhcpv6_msg_option(&msg, DHCPV6_OPT_CLIENTID)))
         return;
 
     syslog(LOG_NOTICE, "Got DHCPv6 request");
@@ -238,64 +564,471 @@ static void handle_client_request(void *addr, void *data, size_t len,
 
     }
 
-    uint8_t pdbuf[512];
-    struct iovec iov[] = {{NULL, 0}, {&dest, (uint8_t*)&dest.clientid_type
-            - (uint8_t*)&dest}, {&dnsaddr, 0}, {&domain, domain_len},
-            {pdbuf, 0}, {NULL, 0}};
+    const size_t relay_len = (uint8_t*)msg.hdr - (uint8_t*)data;
+    uint8_t msg_type = msg.hdr->msg_type;
+    memcpy(dest.tr_id, msg.hdr->transaction_id, sizeof(dest.tr_id));
 
-    uint8_t *opts = (uint8_t*)&hdr[1], *opts_end = (uint8_t*)data + len;
-    if (hdr->msg_type == DHCPV6_MSG_RELAY_FORW)
-        handle_nested_message(data, len, &opts, &opts_end, iov);
-
-    memcpy(dest.tr_id, &opts[-3], sizeof(dest.tr_id));
-
-    if (opts[-4] == DHCPV6_MSG_ADVERTISE || opts[-4] == DHCPV6_MSG_REPLY || opts[-4] == DHCPV6_MSG_RELAY_REPL)
+    if (msg_type == DHCPV6_MSG_ADVERTISE || msg_type == DHCPV6_MSG_REPLY ||
+            msg_type == DHCPV6_MSG_LEASEQUERY_REPLY)
         return;
 
-    if (opts[-4] == DHCPV6_MSG_SOLICIT) {
+    if (msg_type == DHCPV6_MSG_SOLICIT)
         dest.msg_type = DHCPV6_MSG_ADVERTISE;
-    } else if (opts[-4] == DHCPV6_MSG_INFORMATION_REQUEST) {
-        iov[4].iov_base = &refresh;
-        iov[4].iov_len = sizeof(refresh);
-    }
-
-    // Go through options and find what we need
-    uint16_t otype, olen;
-    uint8_t *odata;
-    dhcpv6_for_each_option(opts, opts_end, otype, olen, odata) {
-        if (otype == DHCPV6_OPT_CLIENTID && olen <= 130) {
-            dest.clientid_length = htons(olen);
-            memcpy(dest.clientid_buf, odata, olen);
-            iov[1].iov_len += 4 + olen;
-        } else if (otype == DHCPV6_OPT_SERVERID) {
-            if (olen != ntohs(dest.serverid_length) ||
-                    memcmp(odata, &dest.duid_type, olen))
-                return; // Not for us
-        }
+    else if (msg_type == DHCPV6_MSG_LEASEQUERY)
+        dest.msg_type = DHCPV6_MSG_LEASEQUERY_REPLY;
+
+    size_t dest_len = (uint8_t*)&dest.clientid_type - (uint8_t*)&dest;
+    const struct dhcpv6_option *o;
+    if ((o = dhcpv6_msg_option(&msg, DHCPV6_OPT_CLIENTID)) && o->len <= 130) {
+        dest.clientid_length = htons(o->len);
+        memcpy(dest.clientid_buf, o->data, o->len);
+        dest_len += 4 + o->len;
     }
 
-    if (opts[-4] != DHCPV6_MSG_INFORMATION_REQUEST) {
-        iov[4].iov_len = dhcpv6_handle_ia(pdbuf, sizeof(pdbuf), iface, addr, &opts[-4], opts_end);
-        if (iov[4].iov_len == 0 && opts[-4] == DHCPV6_MSG_REBIND)
-            return;
-    }
+    if ((o = dhcpv6_msg_option(&msg, DHCPV6_OPT_SERVERID)) &&
+            (o->len != ntohs(dest.serverid_length) ||
+            memcmp(o->data, &dest.duid_type, o->len)))
+        return; // Not for us
 
+    size_t dnsaddr_len = 0;
     if (!IN6_IS_ADDR_UNSPECIFIED(&config->dnsaddr)) {
         dnsaddr.addr = config->dnsaddr;
-        iov[2].iov_len = sizeof(dnsaddr);
+        dnsaddr_len = sizeof(dnsaddr);
     } else {
         struct relayd_ipaddr ipaddr;
-        if (relayd_get_interface_addresses(iface->ifindex, &ipaddr, 1) == 1) {
+        if (relayd_get_interface_addresses(iface, &ipaddr, 1) == 1) {
             dnsaddr.addr = ipaddr.addr;
-            iov[2].iov_len = sizeof(dnsaddr);
+            dnsaddr_len = sizeof(dnsaddr);
         }
     }
 
-    if (iov[0].iov_len > 0) // Update length
-        update_nested_message(data, len, iov[1].iov_len + iov[2].iov_len +
-                iov[3].iov_len + iov[4].iov_len - (4 + opts_end - opts));
+    // Size the reply to the link MTU minus IPv6 and UDP headers
+    int mtu = relayd_get_interface_mtu(iface);
+    if (mtu < 1280)
+        mtu = 1280;
+
+    struct dhcpv6_reply reply;
+    dhcpv6_reply_init(&reply, mtu - 48);
+
+    // Relay headers are echoed back up to the innermost message
+    bool fits = dhcpv6_reply_append(&reply, data, relay_len) &&
+            dhcpv6_reply_append(&reply, &dest, dest_len);
+
+    if (fits && msg_type == DHCPV6_MSG_LEASEQUERY) {
+        fits = dhcpv6_handle_leasequery(&reply, iface, &msg) >= 0;
+    } else if (fits && msg_type == DHCPV6_MSG_INFORMATION_REQUEST) {
+        fits = dhcpv6_reply_append(&reply, &dnsaddr, dnsaddr_len) &&
+                dhcpv6_reply_append(&reply, &domain, domain_len) &&
+                dhcpv6_reply_append(&reply, &refresh, sizeof(refresh));
+    } else if (fits) {
+        fits = dhcpv6_reply_append(&reply, &dnsaddr, dnsaddr_len) &&
+                dhcpv6_reply_append(&reply, &domain, domain_len);
+
+        // Bindings are only committed if the whole reply fits
+        ssize_t ia_len = (fits) ? dhcpv6_handle_ia(&reply, iface, addr, &msg) : -1;
+        if (ia_len == 0 && msg_type == DHCPV6_MSG_REBIND)
+            return;
+
+        fits = (ia_len >= 0);
+    }
+
+    if (!fits) {
+        syslog(LOG_WARNING, "DHCPv6 reply on %s exceeds %d bytes, dropped",
+                iface->ifname, mtu);
+        return;
+    }
+
+    if (msg.relay_cnt > 0) // Update length
+        update_nested_message(&msg, reply.len - relay_len -
+                (msg.end - (uint8_t*)msg.hdr));
+
+    relayd_forward_packet(relayd_shard_socket(&dhcpv6_event, iface->netns),
+            addr, reply.iov, reply.iov_cnt, iface);
+}
+
+
+static struct relay_server* find_server(const struct sockaddr_in6 *addr)
+{
+    for (size_t i = 0; i < server_cnt; ++i)
+        if (IN6_ARE_ADDR_EQUAL(&servers[i].addr.sin6_addr, &addr->sin6_addr))
+            return &servers[i];
+
+    return NULL;
+}
+
 
-    relayd_forward_packet(dhcpv6_event.socket, addr, iov, 5, iface);
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ ((const uint8_t*)data)[i]) * 16777619U;
+    return hash;
+}
+
+
+static struct relay_stats* stats_for_slave(const struct relayd_interface *iface)
+{
+    return &slave_stats[iface - config->slaves];
+}
+
+
+static void account_latency(struct relay_stats *stats, uint64_t latency)
+{
+    size_t bucket = 0;
+    while (bucket < RELAY_LATENCY_BUCKETS - 1 && latency >= (1ULL << (2 * bucket)))
+        ++bucket;
+
+    ++stats->latency[bucket];
+    ++stats->replies;
+}
+
+
+// Charge one request to a GCRA bucket, false if it is exhausted
+static bool gcra(uint64_t *tat, uint64_t now, unsigned burst, unsigned interval)
+{
+    if (*tat < now)
+        *tat = now;
+    else if (*tat - now >= (uint64_t)burst * interval)
+        return false;
+
+    *tat += interval;
+    return true;
+}
+
+
+// Buckets are only recycled once refilled, so evicting one loses no state.
+// New keys draw from a shared budget so that random DUIDs or sources
+// cannot flush the buckets of well-behaved clients.
+static bool admit_key(uint32_t key, uint64_t now, uint32_t *shed)
+{
+    struct admission_bucket *set = admission[key % ADMISSION_SETS];
+    struct admission_bucket *b = NULL;
+    for (size_t i = 0; i < ADMISSION_WAYS; ++i) {
+        if (set[i].used && set[i].key == key) {
+            b = &set[i];
+            break;
+        } else if (!b && (!set[i].used || set[i].tat <= now)) {
+            b = &set[i];
+        }
+    }
+
+    if (!b || !b->used || b->key != key) {
+        if (!b || !gcra(&admission_new_tat, now,
+                ADMISSION_NEW_BURST, ADMISSION_NEW_INTERVAL)) {
+            ++shed_new;
+            return false;
+        }
+
+        b->used = true;
+        b->key = key;
+        b->tat = now;
+    }
+
+    if (!gcra(&b->tat, now, ADMISSION_BURST, ADMISSION_INTERVAL)) {
+        ++*shed;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Rate-limit clients by DUID and, unless relayed, by source address
+static bool admit_request(const struct sockaddr_in6 *source, uint8_t type,
+        bool relayed, const struct dhcpv6_option *clientid)
+{
+    uint64_t now = relayd_monotonic_ms();
+
+    // Degrade predictably when falling behind on the socket
+    unsigned load = relayd_receive_load();
+    bool maintenance = (type == DHCPV6_MSG_RENEW || type == DHCPV6_MSG_REBIND ||
+            type == DHCPV6_MSG_RELEASE || type == DHCPV6_MSG_DECLINE);
+    if ((load >= SHED_SOLICIT && type == DHCPV6_MSG_SOLICIT) ||
+            (load >= SHED_RELAY && !config->enable_dhcpv6_server) ||
+            (load >= SHED_LOCAL && !maintenance)) {
+        ++shed_load;
+        return false;
+    }
+
+    if (!relayed && !admit_key(fnv1a(2166136261U,
+            &source->sin6_addr, sizeof(source->sin6_addr)), now, &shed_source))
+        return false;
+
+    return !clientid || admit_key(fnv1a(16777619U, clientid->data,
+            clientid->len), now, &shed_duid);
+}
+
+
+// Leasequeries are sent directly by requestors, never relayed
+static bool is_requestor(const struct sockaddr_in6 *source,
+        const struct dhcpv6_msg *msg)
+{
+    if (msg->relay_cnt > 0)
+        return false;
+
+    for (size_t i = 0; i < requestor_cnt; ++i)
+        if (IN6_ARE_ADDR_EQUAL(&requestors[i], &source->sin6_addr))
+            return true;
+
+    return false;
+}
+
+
+static struct relay_transaction* find_transaction(struct relayd_interface *iface,
+        const struct in6_addr *peer, const uint8_t xid[3], bool create)
+{
+    uint32_t hash = fnv1a(2166136261U, &iface->ifindex, sizeof(iface->ifindex));
+    hash = fnv1a(hash, peer, sizeof(*peer));
+    hash = fnv1a(hash, xid, 3);
+
+    struct relay_transaction *set = transactions[hash % RELAY_TRANSACTION_SETS];
+    struct relay_transaction *free = NULL;
+    for (size_t i = 0; i < RELAY_TRANSACTION_WAYS; ++i) {
+        struct relay_transaction *t = &set[i];
+        if (!t->used) {
+            if (!free)
+                free = t;
+        } else if (t->iface == iface && !memcmp(t->xid, xid, 3) &&
+                IN6_ARE_ADDR_EQUAL(&t->peer, peer)) {
+            return t;
+        } else if (!free || (free->used && t->forwarded_at < free->forwarded_at)) {
+            free = t; // Evict the oldest transaction if the set is full
+        }
+    }
+
+    if (!create)
+        return NULL;
+
+    free->used = true;
+    free->iface = iface;
+    free->peer = *peer;
+    memcpy(free->xid, xid, 3);
+    free->forwarded_at = 0;
+    free->server = NULL;
+    return free;
+}
+
+
+static void server_timeout(struct relay_server *s, uint64_t now)
+{
+    ++s->stats.timeouts;
+    if (++s->lost < RELAY_SERVER_MAX_LOSS || s->down_until > now)
+        return;
+
+    char ipbuf[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &s->addr.sin6_addr, ipbuf, sizeof(ipbuf));
+    syslog(LOG_WARNING, "DHCPv6 server %s is not responding "
+            "(%u forwarded, %u replies, %ums response time)", ipbuf,
+            s->stats.forwarded, s->stats.replies, s->srtt);
+
+    // Fail over for a while, afterwards the server gets requests as a probe
+    s->down_until = now + RELAY_SERVER_HOLDDOWN;
+    s->lost = 0;
+}
+
+
+// Count forwarded requests that never saw a reply
+static void expire_transactions(struct relayd_event *event)
+{
+    uint64_t cnt;
+    if (read(event->socket, &cnt, sizeof(cnt))) {
+        // Avoid compiler warning
+    }
+
+    uint64_t now = relayd_monotonic_ms();
+    for (size_t i = 0; i < RELAY_TRANSACTION_SETS; ++i) {
+        for (size_t j = 0; j < RELAY_TRANSACTION_WAYS; ++j) {
+            struct relay_transaction *t = &transactions[i][j];
+            if (!t->used || now - t->forwarded_at < RELAY_TRANSACTION_TIMEOUT)
+                continue;
+
+            if (t->iface->upstream)
+                ++stats_for_slave(t->iface)->timeouts;
+
+            if (t->server)
+                server_timeout(t->server, now);
+
+            t->used = false;
+        }
+    }
+
+    // Withdraw routes of delegations that ran out
+    for (size_t i = 0; pd_route_cnt > 0 && i < RELAY_PD_ROUTES; ++i) {
+        struct relay_pd_route *p = &pd_routes[i];
+        if (!p->used || p->valid_until > now)
+            continue;
+
+        relayd_setup_route(&p->prefix, p->length, p->iface, &p->peer, 0, false);
+
+        p->used = false;
+        --pd_route_cnt;
+        ++pd_route_expired;
+    }
+}
+
+
+// Install, refresh or withdraw routes for the IA_PD prefixes of a message
+static void learn_pd_routes(struct relayd_interface *iface,
+        const struct in6_addr *peer, const struct dhcpv6_msg *msg, bool add)
+{
+    if (!IN6_IS_ADDR_LINKLOCAL(peer))
+        return; // Not a directly attached client
+
+    uint64_t now = relayd_monotonic_ms();
+    for (size_t i = 0; i < msg->ia_cnt; ++i) {
+        struct dhcpv6_ia_hdr *ia = msg->ia[i].ia;
+        if (ia->type != htons(DHCPV6_OPT_IA_PD))
+            continue;
+
+        uint16_t otype, olen;
+        uint8_t *odata;
+        bool failed = false;
+        dhcpv6_for_each_option((uint8_t*)&ia[1], msg->ia[i].end, otype, olen, odata)
+            if (otype == DHCPV6_OPT_STATUS && olen >= 2 &&
+                    (odata[0] << 8 | odata[1]) != DHCPV6_STATUS_OK)
+                failed = true;
+
+        if (failed && add)
+            continue; // Nothing was delegated
+
+        dhcpv6_for_each_option((uint8_t*)&ia[1], msg->ia[i].end, otype, olen, odata) {
+            if (otype != DHCPV6_OPT_IA_PREFIX ||
+                    olen < sizeof(struct dhcpv6_ia_prefix) - 4)
+                continue;
+
+            struct dhcpv6_ia_prefix *p = (struct dhcpv6_ia_prefix*)&odata[-4];
+            struct in6_addr prefix;
+            memcpy(&prefix, &p->addr, sizeof(prefix));
+            uint32_t valid = ntohl(p->valid);
+
+            if (p->prefix == 0 || p->prefix > 128 ||
+                    IN6_IS_ADDR_LINKLOCAL(&prefix) || IN6_IS_ADDR_MULTICAST(&prefix))
+                continue;
+
+            struct relay_pd_route *r = NULL, *free_slot = NULL;
+            for (size_t j = 0; j < RELAY_PD_ROUTES && !r; ++j) {
+                struct relay_pd_route *c = &pd_routes[j];
+                if (c->used && c->length == p->prefix &&
+                        c->iface->netns == iface->netns &&
+                        IN6_ARE_ADDR_EQUAL(&c->prefix, &prefix))
+                    r = c;
+                else if (!c->used && !free_slot)
+                    free_slot = c;
+            }
+
+            if (!add || valid == 0) {
+                // Only the client holding a delegation may give it up
+                if (r && r->iface == iface &&
+                        IN6_ARE_ADDR_EQUAL(&r->peer, peer)) {
+                    relayd_setup_route(&r->prefix, r->length, iface, &r->peer, 0, false);
+                    r->used = false;
+                    --pd_route_cnt;
+                }
+                continue;
+            }
+
+            if (!r && !(r = free_slot)) {
+                ++pd_route_dropped;
+                continue;
+            }
+
+            bool changed = !r->used || r->iface != iface ||
+                    !IN6_ARE_ADDR_EQUAL(&r->peer, peer);
+            if (!r->used) {
+                ++pd_route_cnt;
+                ++pd_route_learned;
+            }
+
+            r->used = true;
+            r->prefix = prefix;
+            r->length = p->prefix;
+            r->peer = *peer;
+            r->iface = iface;
+            r->valid_until = (valid == UINT32_MAX) ? UINT64_MAX :
+                    now + valid * 1000ULL;
+
+            if (changed)
+                relayd_setup_route(&r->prefix, r->length, iface, &r->peer, 0, true);
+        }
+    }
+}
+
+
+static void dump_stats(FILE *fp, const char *kind, const char *name,
+        const struct relay_stats *stats)
+{
+    fprintf(fp, "dhcpv6_relay_%s %s forwarded %u replies %u timeouts %u "
+            "duplicates %u latency_ms", kind, name, stats->forwarded,
+            stats->replies, stats->timeouts, stats->duplicates);
+
+    for (size_t i = 0; i < RELAY_LATENCY_BUCKETS - 1; ++i)
+        fprintf(fp, " <%llu:%u", 1ULL << (2 * i), stats->latency[i]);
+
+    fprintf(fp, " >=%llu:%u\n", 1ULL << (2 * (RELAY_LATENCY_BUCKETS - 2)),
+            stats->latency[RELAY_LATENCY_BUCKETS - 1]);
+}
+
+
+void dump_dhcpv6_relay_stats(FILE *fp)
+{
+    if (!slave_stats)
+        return;
+
+    fprintf(fp, "dhcpv6_admission shed_source %u shed_duid %u shed_new %u shed_load %u\n",
+            shed_source, shed_duid, shed_new, shed_load);
+
+    if (!config->enable_dhcpv6_server && config->enable_route_learning)
+        fprintf(fp, "dhcpv6_relay_pd routes %zu learned %u expired %u dropped %u\n",
+                pd_route_cnt, pd_route_learned, pd_route_expired, pd_route_dropped);
+
+    if (config->enable_dhcpv6_server)
+        dhcpv6_dump_ia_stats(fp);
+
+    for (size_t i = 0; i < server_cnt; ++i) {
+        char ipbuf[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &servers[i].addr.sin6_addr, ipbuf, sizeof(ipbuf));
+        dump_stats(fp, "server", ipbuf, &servers[i].stats);
+    }
+
+    for (size_t i = 0; i < config->slavecount; ++i)
+        dump_stats(fp, "iface", config->slaves[i].name, &slave_stats[i]);
+}
+
+
+static bool server_is_up(struct relay_server *s, uint64_t now)
+{
+    return s->down_until <= now;
+}
+
+
+// Select a server by rendezvous hashing of the client DUID over healthy
+// servers, so each client sticks to one server and only clients of a
+// failed server move.
+static struct relay_server* select_server(const uint8_t *duid, size_t len)
+{
+    uint64_t now = relayd_monotonic_ms();
+    struct relay_server *best = NULL, *best_down = NULL;
+    uint32_t best_score = 0, best_down_score = 0;
+
+    for (size_t i = 0; i < server_cnt; ++i) {
+        struct relay_server *s = &servers[i];
+
+        uint32_t score = fnv1a(2166136261U, &s->addr.sin6_addr,
+                sizeof(s->addr.sin6_addr));
+        score = fnv1a(score, duid, len);
+
+        if (server_is_up(s, now)) {
+            if (!best || score > best_score) {
+                best = s;
+                best_score = score;
+            }
+        } else if (!best_down || score > best_down_score) {
+            best_down = s;
+            best_down_score = score;
+        }
+    }
+
+    // All servers failed: keep trying rather than dropping the request
+    return (best) ? best : best_down;
 }
 
 
@@ -303,71 +1036,90 @@ static void handle_client_request(void *addr, void *data, size_t len,
 static void handle_dhcpv6(void *addr, void *data, size_t len,
         struct relayd_interface *iface)
 {
-    if (iface == &config->master)
-        relay_server_response(data, len);
+    // Server replies are only taken from masters, slaves are client-facing
+    // and anyone there could spoof a server address
+    if (!iface->upstream)
+        relay_server_response(data, len, addr, iface->netns);
     else
         relay_client_request(addr, data, len, iface);
 }
 
 
 // Relay server response (regular relay server handling)
-static void relay_server_response(uint8_t *data, size_t len)
+static void relay_server_response(uint8_t *data, size_t len,
+        const struct sockaddr_in6 *source, size_t netns)
 {
-    // Information we need to gather
-    uint8_t *payload_data = NULL;
-    size_t payload_len = 0;
-    int32_t ifaceidx = 0;
     struct sockaddr_in6 target = {AF_INET6, htons(DHCPV6_CLIENT_PORT),
         0, IN6ADDR_ANY_INIT, 0};
 
     syslog(LOG_NOTICE, "Got a DHCPv6-reply");
 
-    int otype, olen;
-    uint8_t *odata, *end = data + len;
-
     // Relay DHCPv6 reply from server to client
-    struct dhcpv6_relay_header *h = (void*)data;
-    if (len < sizeof(*h) || h->msg_type != DHCPV6_MSG_RELAY_REPL)
+    struct dhcpv6_msg msg;
+    if (dhcpv6_parse_message(&msg, data, len) || msg.relay_cnt < 1 ||
+            msg.relay[0].hdr->msg_type != DHCPV6_MSG_RELAY_REPL)
         return;
 
-    memcpy(&target.sin6_addr, &h->peer_address,
+    const struct dhcpv6_relay_layer *r = &msg.relay[0];
+    memcpy(&target.sin6_addr, &r->hdr->peer_address,
             sizeof(struct in6_addr));
 
-    // Go through options and find what we need
-    dhcpv6_for_each_option(h->options, end, otype, olen, odata) {
-        if (otype == DHCPV6_OPT_INTERFACE_ID
-                && olen == sizeof(ifaceidx)) {
-            memcpy(&ifaceidx, odata, sizeof(ifaceidx));
-        } else if (otype == DHCPV6_OPT_RELAY_MSG) {
-            payload_data = odata;
-            payload_len = olen;
+    int32_t ifaceidx = 0;
+    if (r->interface_id && r->interface_id_len == sizeof(ifaceidx))
+        memcpy(&ifaceidx, r->interface_id, sizeof(ifaceidx));
+
+    // Invalid interface-id or basic payload, the interface-id is an
+    // ifindex of the namespace the reply came in
+    struct relayd_interface *iface = relayd_get_interface_by_index(netns, ifaceidx);
+    if (!iface || !iface->upstream)
+        return;
+
+    // Match the reply to its forwarded request
+    struct in6_addr peer;
+    memcpy(&peer, &r->hdr->peer_address, sizeof(peer));
+    struct relay_transaction *t = find_transaction(iface,
+            &peer, msg.hdr->transaction_id, false);
+    if (t) {
+        uint64_t latency = relayd_monotonic_ms() - t->forwarded_at;
+        account_latency(stats_for_slave(iface), latency);
+
+        struct relay_server *s = t->server;
+        if (s) {
+            account_latency(&s->stats, latency);
+            s->srtt = (s->srtt) ? (7 * s->srtt + latency) / 8 : latency;
         }
+
+        t->used = false;
     }
 
-    // Invalid interface-id or basic payload
-    struct relayd_interface *iface = relayd_get_interface_by_index(ifaceidx);
-    if (!iface || iface == &config->master || !payload_data || payload_len < 4)
-        return;
+    struct relay_server *s = find_server(source);
+    if (s) {
+        s->lost = 0;
+        s->down_until = 0;
+    }
 
+    // Route prefixes delegated to a directly attached client
+    if (config->enable_route_learning && msg.relay_cnt == 1 &&
+            msg.hdr->msg_type == DHCPV6_MSG_REPLY)
+        learn_pd_routes(iface, &peer, &msg, true);
+
+    uint8_t *payload_data = r->relay_msg;
+    size_t payload_len = r->relay_msg_len;
     bool is_authenticated = false;
     struct in6_addr *dns_ptr = NULL;
     size_t dns_count = 0;
 
     // If the payload is relay-reply we have to send to the server port
-    if (payload_data[0] == DHCPV6_MSG_RELAY_REPL) {
+    if (msg.relay_cnt > 1) {
         target.sin6_port = htons(DHCPV6_SERVER_PORT);
     } else { // Go through the payload data
-        struct dhcpv6_client_header *h = (void*)payload_data;
-        end = payload_data + payload_len;
-
-        dhcpv6_for_each_option(&h[1], end, otype, olen, odata) {
-            if (otype == DHCPV6_OPT_DNS_SERVERS && olen >= 16) {
-                dns_ptr = (struct in6_addr*)odata;
-                dns_count = olen / 16;
-            } else if (otype == DHCPV6_OPT_AUTH) {
-                is_authenticated = true;
-            }
+        const struct dhcpv6_option *o;
+        if ((o = dhcpv6_msg_option(&msg, DHCPV6_OPT_DNS_SERVERS)) && o->len >= 16) {
+            dns_ptr = (struct in6_addr*)o->data;
+            dns_count = o->len / 16;
         }
+
+        is_authenticated = !!dhcpv6_msg_option(&msg, DHCPV6_OPT_AUTH);
     }
 
     // Rewrite DNS servers if requested
@@ -381,7 +1133,7 @@ static void relay_server_response(uint8_t *data, size_t len)
         if (!IN6_IS_ADDR_UNSPECIFIED(&config->dnsaddr)) {
             rewrite = &config->dnsaddr;
         } else {
-            if (relayd_get_interface_addresses(iface->ifindex, &ip, 1) < 1)
+            if (relayd_get_interface_addresses(iface, &ip, 1) < 1)
                 return; // Unable to get interface address
             rewrite = &ip.addr;
         }
@@ -392,7 +1144,8 @@ static void relay_server_response(uint8_t *data, size_t len)
     }
 
     struct iovec iov = {payload_data, payload_len};
-    relayd_forward_packet(dhcpv6_event.socket, &target, &iov, 1, iface);
+    relayd_forward_packet(relayd_shard_socket(&dhcpv6_event, iface->netns),
+            &target, &iov, 1, iface);
 }
 
 
@@ -433,13 +1186,13 @@ static void relay_client_request(struct sockaddr_in6 *source,
 
     // Detect public IP of slave interface to use as link-address
     struct relayd_ipaddr ip;
-    if (relayd_get_interface_addresses(iface->ifindex, &ip, 1) < 1) {
+    if (relayd_get_interface_addresses(iface, &ip, 1) < 1) {
         // No suitable address! Is the slave not configured yet?
         // Detect public IP of master interface and use it instead
         // This is WRONG and probably violates the RFC. However
         // otherwise we have a hen and egg problem because the
         // slave-interface cannot be auto-configured.
-        if (relayd_get_interface_addresses(config->master.ifindex,
+        if (relayd_get_interface_addresses(iface->upstream,
                 &ip, 1) < 1)
             return; // Could not obtain a suitable address
     }
@@ -448,6 +1201,54 @@ static void relay_client_request(struct sockaddr_in6 *source,
     struct sockaddr_in6 dhcpv6_servers = {AF_INET6,
             htons(DHCPV6_SERVER_PORT), 0, ALL_DHCPV6_SERVERS, 0};
     struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void*)data, len}};
-    relayd_forward_packet(dhcpv6_event.socket, &dhcpv6_servers,
-            iov, 2, &config->master);
+
+    // Messages we can't parse are still relayed opaquely, only without
+    // transaction tracking and route learning
+    struct dhcpv6_msg msg;
+    bool parsed = !dhcpv6_parse_message(&msg, (uint8_t*)data, len);
+    const struct dhcpv6_option *clientid = (parsed) ?
+            dhcpv6_msg_option(&msg, DHCPV6_OPT_CLIENTID) : NULL;
+
+    // Released prefixes are unreachable no matter what the server replies
+    if (parsed && config->enable_route_learning && msg.relay_cnt == 0 &&
+            msg.hdr->msg_type == DHCPV6_MSG_RELEASE)
+        learn_pd_routes(iface, &source->sin6_addr, &msg, false);
+
+    // Suppress retransmits of requests still in flight upstream
+    uint64_t now = relayd_monotonic_ms();
+    struct relay_stats *stats = stats_for_slave(iface);
+    struct relay_transaction *t = (parsed) ? find_transaction(iface,
+            &source->sin6_addr, msg.hdr->transaction_id, false) : NULL;
+    if (t && now - t->forwarded_at < RELAY_TRANSACTION_TIMEOUT) {
+        ++stats->duplicates;
+        return;
+    }
+
+    uint8_t type = (parsed) ? msg.hdr->msg_type : h->msg_type;
+    bool relayed = (parsed) ? msg.relay_cnt > 0 : h->msg_type == DHCPV6_MSG_RELAY_FORW;
+    if (!admit_request(source, type, relayed, clientid))
+        return;
+
+    if (parsed && !t)
+        t = find_transaction(iface, &source->sin6_addr,
+                msg.hdr->transaction_id, true);
+
+    // With unicast servers configured each request goes to exactly one
+    struct relay_server *s = NULL;
+    if (server_cnt > 0) {
+        s = (clientid) ? select_server(clientid->data, clientid->len) :
+                select_server(source->sin6_addr.s6_addr, sizeof(source->sin6_addr));
+
+        ++s->stats.forwarded;
+        dhcpv6_servers = s->addr;
+    }
+
+    ++stats->forwarded;
+    if (t) {
+        t->forwarded_at = now;
+        t->server = s;
+    }
+
+    relayd_forward_packet(relayd_shard_socket(&dhcpv6_event, iface->upstream->netns),
+            &dhcpv6_servers, iov, 2, iface->upstream);
 }
@@ -35,6 +35,8 @@
 #define DHCPV6_MSG_INFORMATION_REQUEST 11
 #define DHCPV6_MSG_RELAY_FORW 12
 #define DHCPV6_MSG_RELAY_REPL 13
+#define DHCPV6_MSG_LEASEQUERY 14
+#define DHCPV6_MSG_LEASEQUERY_REPLY 15
 
 #define DHCPV6_OPT_CLIENTID 1
 #define DHCPV6_OPT_SERVERID 2
@@ -52,6 +54,9 @@
 #define DHCPV6_OPT_IA_PREFIX 26
 #define DHCPV6_OPT_INFO_REFRESH 32
 #define DHCPV6_OPT_FQDN 39
+#define DHCPV6_OPT_LQ_QUERY 44
+#define DHCPV6_OPT_CLIENT_DATA 45
+#define DHCPV6_OPT_CLT_TIME 46
 
 #define DHCPV6_DUID_VENDOR 2
 
@@ -60,6 +65,11 @@
 #define DHCPV6_STATUS_NOBINDING 3
 #define DHCPV6_STATUS_NOTONLINK 4
 #define DHCPV6_STATUS_NOPREFIXAVAIL 6
+#define DHCPV6_STATUS_UNKNOWNQUERYTYPE 7
+#define DHCPV6_STATUS_MALFORMEDQUERY 8
+
+#define DHCPV6_LQ_QUERY_BY_ADDRESS 1
+#define DHCPV6_LQ_QUERY_BY_CLIENTID 2
 
 // I just remembered I have an old one lying around...
 #define DHCPV6_ENT_NO  30462
@@ -138,6 +148,81 @@ struct dhcpv6_ia_addr {
         ((olen) = _o[2] << 8 | _o[3]) + (odata) <= (end); \
         _o += 4 + (_o[2] << 8 | _o[3]))
 
-int dhcpv6_init_ia(const struct relayd_config *relayd_config, int socket);
-size_t dhcpv6_handle_ia(uint8_t *buf, size_t buflen, struct relayd_interface *iface,
-        const struct sockaddr_in6 *addr, const void *data, const uint8_t *end);
+
+// Index of a DHCPv6 message built by a single validating pass
+#define DHCPV6_MAX_OPTIONS 64
+#define DHCPV6_MAX_IA 16
+#define DHCPV6_OPT_INDEXED 48 // Option codes below have a direct lookup
+
+struct dhcpv6_option {
+    uint16_t type;
+    uint16_t len;
+    uint8_t *data;
+    int next; // Next option of the same type or -1
+};
+
+struct dhcpv6_relay_layer {
+    struct dhcpv6_relay_header *hdr;
+    uint8_t *relay_msg;
+    uint16_t relay_msg_len;
+    uint8_t *interface_id;
+    uint16_t interface_id_len;
+};
+
+struct dhcpv6_ia_index {
+    struct dhcpv6_ia_hdr *ia;
+    uint8_t *end;
+    struct dhcpv6_ia_prefix *hint; // First IA_PREFIX of an IA_PD
+};
+
+struct dhcpv6_msg {
+    // Relay layers from the outermost inwards
+    size_t relay_cnt;
+    struct dhcpv6_relay_layer relay[DHCPV6_HOP_COUNT_LIMIT];
+
+    // Innermost client or server message
+    struct dhcpv6_client_header *hdr;
+    uint8_t *end;
+
+    size_t opt_cnt;
+    struct dhcpv6_option opt[DHCPV6_MAX_OPTIONS];
+    int8_t first[DHCPV6_OPT_INDEXED];
+
+    size_t ia_cnt;
+    struct dhcpv6_ia_index ia[DHCPV6_MAX_IA];
+};
+
+#define dhcpv6_msg_for_each_option(msg, code, o)\
+    for ((o) = dhcpv6_msg_option((msg), (code)); (o);\
+        (o) = ((o)->next >= 0) ? &(msg)->opt[(o)->next] : NULL)
+
+// Reply builder assembling options into a chain of preallocated segments
+#define DHCPV6_REPLY_SEGMENT_SIZE 512
+#define DHCPV6_REPLY_SEGMENTS 16
+#define DHCPV6_REPLY_IOV 32
+
+struct dhcpv6_reply {
+    struct iovec iov[DHCPV6_REPLY_IOV];
+    size_t iov_cnt;
+    size_t len;
+    size_t maxlen;
+    size_t seg;
+    size_t seg_used;
+};
+
+int dhcpv6_parse_message(struct dhcpv6_msg *msg, uint8_t *data, size_t len);
+const struct dhcpv6_option* dhcpv6_msg_option(const struct dhcpv6_msg *msg,
+        uint16_t code);
+
+void dhcpv6_reply_init(struct dhcpv6_reply *reply, size_t maxlen);
+bool dhcpv6_reply_append(struct dhcpv6_reply *reply, const void *data, size_t len);
+void* dhcpv6_reply_reserve(struct dhcpv6_reply *reply, size_t len);
+bool dhcpv6_reply_append_copy(struct dhcpv6_reply *reply, const void *data, size_t len);
+
+int dhcpv6_init_ia(const struct relayd_config *relayd_config,
+        const struct relayd_event *event);
+void dhcpv6_dump_ia_stats(FILE *fp);
+ssize_t dhcpv6_handle_ia(struct dhcpv6_reply *reply, struct relayd_interface *iface,
+        const struct sockaddr_in6 *addr, const struct dhcpv6_msg *msg);
+ssize_t dhcpv6_handle_leasequery(struct dhcpv6_reply *reply,
+        const struct relayd_interface *iface, const struct dhcpv6_msg *msg);
@@ -0,0 +1,135 @@
+/**
+ * Copyright (C) 2013 Steven Barth <steven@midlink.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License v2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+// Shared memory lease table published by 6relayd (-b <path>)
+//
+// The table is a single mapping protected by a sequence lock: the writer
+// makes seq odd before changing entries and even again afterwards, readers
+// copy the entries and retry if seq was odd or changed meanwhile.
+// A restarted 6relayd replaces the file, readers should reopen the table
+// when writer_pid no longer matches a running process. leasetable_snapshot
+// fails with ESRCH in that case and with EAGAIN if it keeps losing races.
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#define LEASETABLE_MAGIC 0x364c5442
+#define LEASETABLE_VERSION 2
+#define LEASETABLE_CAPACITY 4096
+#define LEASETABLE_MAX_ADDRS 8
+#define LEASETABLE_RETRIES 1000 // Attempts before a snapshot gives up
+
+struct leasetable_entry {
+    char netns[64]; // Network namespace as configured, empty for our own
+    char ifname[16];
+    uint32_t iaid;
+    uint32_t valid_until; // Wall clock, entries are active leases as of updated
+    uint32_t assigned;
+    uint8_t length; // 128 for IA_NA, prefix length for IA_PD
+    uint8_t addr_cnt;
+    uint8_t clid_len;
+    uint8_t clid[130];
+    char hostname[64];
+    struct in6_addr addr[LEASETABLE_MAX_ADDRS];
+};
+
+struct leasetable {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t writer_pid;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t dropped; // Bindings not published for lack of capacity
+    uint32_t updated; // Wall clock of the last update
+    struct leasetable_entry entries[];
+};
+
+
+// Map a lease table read-only, NULL on error
+static inline const struct leasetable* leasetable_open(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof(struct leasetable))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const struct leasetable *table = map;
+    if (table->magic != LEASETABLE_MAGIC || table->version != LEASETABLE_VERSION ||
+            sizeof(*table) + table->capacity * sizeof(table->entries[0]) >
+                    (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return table;
+}
+
+
+static inline void leasetable_close(const struct leasetable *table, size_t size)
+{
+    munmap((void*)table, size);
+}
+
+
+// Copy a consistent snapshot of up to max entries, returns the entry count
+// or -1 with errno set if the writer died or kept the table busy
+static inline ssize_t leasetable_snapshot(const struct leasetable *table,
+        struct leasetable_entry *entries, size_t max)
+{
+    for (size_t i = 0; i < LEASETABLE_RETRIES; ++i) {
+        uint32_t seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) { // Update in progress, unless the writer died in it
+            if (kill(table->writer_pid, 0) && errno == ESRCH)
+                return -1;
+
+            sched_yield();
+            continue;
+        }
+
+        size_t count = table->count;
+        if (count > table->capacity)
+            count = table->capacity;
+
+        if (count > max)
+            count = max;
+
+        memcpy(entries, table->entries, count * sizeof(*entries));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&table->seq, __ATOMIC_RELAXED) == seq)
+            return count;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
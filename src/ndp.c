@@ -16,6 +16,8 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <unistd.h>
+#include <limits.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -23,6 +25,7 @@
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <netpacket/packet.h>
+#include <sys/timerfd.h>
 
 #include <linux/rtnetlink.h>
 #include <linux/filter.h>
@@ -32,69 +35,265 @@
 
 static const struct relayd_config *config = NULL;
 
+static void handle_ndp(void *addr, void *data, size_t len,
+        struct relayd_interface *iface);
 static void handle_solicit(void *addr, void *data, size_t len,
         struct relayd_interface *iface);
+static void handle_advert(void *addr, void *data, size_t len,
+        struct relayd_interface *iface);
+static void snoop_neighbor(struct in6_addr *addr, struct relayd_interface *iface);
 static void handle_rtnetlink(void *addr, void *data, size_t len,
         struct relayd_interface *iface);
-static struct ndp_neighbor* find_neighbor(struct in6_addr *addr, bool strict);
-static void modify_neighbor(struct in6_addr *addr, struct relayd_interface *iface,
-        bool add);
+static struct ndp_neighbor* find_neighbor(size_t netns, struct in6_addr *addr,
+        bool strict);
+static void modify_neighbor(size_t netns, struct in6_addr *addr,
+        struct relayd_interface *iface, bool add);
+static void free_neighbor(struct ndp_neighbor *n);
+static void install_route(const struct in6_addr *addr, int prefixlen,
+        const struct relayd_interface *iface, uint32_t metric, bool add);
+static void aggregate_route(const struct in6_addr *addr,
+        struct relayd_interface *iface, bool add);
 static ssize_t ping6(struct in6_addr *addr,
         const struct relayd_interface *iface);
+static ssize_t probe_neighbor(struct in6_addr *addr,
+        const struct relayd_interface *except, bool dad);
+static ssize_t send_advert(const struct in6_addr *target,
+        const struct in6_addr *dest, const struct relayd_interface *iface,
+        uint32_t flags);
+static void move_neighbor(struct in6_addr *addr, struct relayd_interface *iface);
+static void uncover_hosts(struct ndp_aggregate *g, const struct in6_addr *except);
+static void queue_keepalive(struct ndp_neighbor *n, bool revalidate);
+static void handle_keepalive(struct relayd_event *event);
+static void restore_snapshot(const char *path);
+static void write_snapshot(const char *path);
+static void handle_snapshot(struct relayd_event *event);
 
 static struct list_head neighbors = LIST_HEAD_INIT(neighbors);
 static size_t neighbor_count = 0;
 static uint32_t rtnl_seqid = 0;
 
-static int ping_socket = -1;
-static struct relayd_event ndp_event_solicit = {-1, NULL, handle_solicit};
-static struct relayd_event rtnl_event = {-1, NULL, handle_rtnetlink};
-
-
-// Filter ICMPv6 messages of type neighbor soliciation
+// Sending sockets, one per namespace and never registered
+static struct relayd_event ping_event = {.socket = -1};
+static struct relayd_event probe_event = {.socket = -1};
+static struct relayd_event ndp_event_solicit = {.socket = -1,
+        .handle_dgram = handle_ndp, .priority = RELAYD_PRIO_HIGH};
+static void resync_rtnetlink(struct relayd_event *event);
+static struct relayd_event rtnl_event = {.socket = -1,
+        .handle_dgram = handle_rtnetlink, .priority = RELAYD_PRIO_LOW,
+        .resync = resync_rtnetlink};
+
+// Neighbor dump of a resync per namespace, the address dump follows it
+static uint32_t *resync_seq = NULL;
+
+// Learned neighbors ordered by their next keepalive
+static struct relayd_event keepalive_event = {.socket = -1,
+        .handle_event = handle_keepalive, .priority = RELAYD_PRIO_HIGH};
+static struct list_head keepalives = LIST_HEAD_INIT(keepalives);
+static size_t keepalive_cnt = 0;
+static uint64_t keepalive_rate = 0;
+static uint64_t keepalive_credit = 0;
+static uint64_t keepalive_last = 0;
+static uint32_t keepalive_sent = 0;
+static uint32_t keepalive_late = 0;
+
+// Learned routes and /64 aggregates
+static struct list_head aggregates = LIST_HEAD_INIT(aggregates);
+static size_t route_cnt = 0;
+static uint32_t route_msgs = 0;
+static uint32_t route_msgs_last = 0;
+static uint64_t route_stats_last = 0;
+
+// Periodic neighbor snapshot for restarts
+static struct relayd_event snapshot_event = {.socket = -1,
+        .handle_event = handle_snapshot, .priority = RELAYD_PRIO_LOW};
+static bool snapshot_dirty = false;
+
+
+// Filter ICMPv6 messages of type neighbor solicitation and advertisement
 static struct sock_filter bpf[] = {
     BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct ip6_hdr, ip6_nxt)),
-    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 3),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 4),
     BPF_STMT(BPF_LD | BPF_B | BPF_ABS, sizeof(struct ip6_hdr) +
             offsetof(struct icmp6_hdr, icmp6_type)),
-    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 0, 1),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_SOLICIT, 1, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ND_NEIGHBOR_ADVERT, 0, 1),
     BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
     BPF_STMT(BPF_RET | BPF_K, 0),
 };
 static const struct sock_fprog bpf_prog = {sizeof(bpf) / sizeof(*bpf), bpf};
 
 
-// Initialize NDP-proxy
-int init_ndp_proxy(const struct relayd_config *relayd_config)
+// Synthesize address events for a namespace
+static void dump_addresses(int sock)
 {
-    config = relayd_config;
-    if (config->slavecount < 1)
-        return 0;
+    struct {
+        struct nlmsghdr nh;
+        struct ifaddrmsg ifa;
+    } req = {
+        {sizeof(req), RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP,
+                __atomic_add_fetch(&rtnl_seqid, 1, __ATOMIC_RELAXED), 0},
+        {.ifa_family = AF_INET6}
+    };
+    send(sock, &req, sizeof(req), MSG_DONTWAIT);
+}
+
 
-    // Setup netlink socket
-    if ((rtnl_event.socket = relayd_open_rtnl_socket()) < 0)
+// Synthesize neighbor events for a namespace, returns the dump sequence
+static uint32_t dump_neighbors(int sock)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ndmsg ndm;
+    } req = {
+        {sizeof(req), RTM_GETNEIGH, NLM_F_REQUEST | NLM_F_DUMP,
+                __atomic_add_fetch(&rtnl_seqid, 1, __ATOMIC_RELAXED), 0},
+        {.ndm_family = AF_INET6}
+    };
+    send(sock, &req, sizeof(req), MSG_DONTWAIT);
+    return req.nh.nlmsg_seq;
+}
+
+
+// The socket overran and notifications are lost: dump neighbors and,
+// once done, addresses again. Netlink only runs one dump at a time.
+static void resync_rtnetlink(struct relayd_event *event)
+{
+    syslog(LOG_WARNING, "Lost rtnetlink notifications, resynchronizing");
+    if (config->enable_ndp_relay && resync_seq)
+        resync_seq[event->netns] = dump_neighbors(event->socket);
+    else
+        dump_addresses(event->socket);
+}
+
+
+// Setup netlink socket of a namespace
+static int open_rtnl_socket(_unused size_t netns)
+{
+    int sock = relayd_open_rtnl_socket();
+    if (sock < 0)
         return -1;
 
     // Receive netlink neighbor and ip-address events
     uint32_t group = RTNLGRP_IPV6_IFADDR;
-    setsockopt(rtnl_event.socket, SOL_NETLINK,
+    setsockopt(sock, SOL_NETLINK,
             NETLINK_ADD_MEMBERSHIP, &group, sizeof(group));
     group = RTNLGRP_IPV6_ROUTE;
-    setsockopt(rtnl_event.socket, SOL_NETLINK,
+    setsockopt(sock, SOL_NETLINK,
             NETLINK_ADD_MEMBERSHIP, &group, sizeof(group));
 
     // Synthesize initial address events
-    struct {
-        struct nlmsghdr nh;
-        struct ifaddrmsg ifa;
-    } req2 = {
-        {sizeof(req2), RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP,
-                ++rtnl_seqid, 0},
-        {.ifa_family = AF_INET6}
-    };
-    send(rtnl_event.socket, &req2, sizeof(req2), MSG_DONTWAIT);
+    dump_addresses(sock);
+    return sock;
+}
 
-    relayd_register_event(&rtnl_event);
+
+// Create socket for intercepting NDP on the interfaces of a namespace
+static int open_packet_socket(size_t netns)
+{
+    int sock = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+            htons(ETH_P_ALL)); // ETH_P_ALL for ingress + egress
+    if (sock < 0) {
+        syslog(LOG_ERR, "Unable to open packet socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER,
+            &bpf_prog, sizeof(bpf_prog))) {
+        syslog(LOG_ERR, "Failed to set BPF: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+
+    struct packet_mreq mreq = {0, PACKET_MR_ALLMULTI, ETH_ALEN, {0}};
+    for (size_t i = 0; i < config->mastercount; ++i) {
+        if (config->masters[i].netns != netns)
+            continue;
+
+        mreq.mr_ifindex = config->masters[i].ifindex;
+        setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                &mreq, sizeof(mreq));
+    }
+
+    for (size_t i = 0; i < config->slavecount; ++i) {
+        if (config->slaves[i].netns != netns)
+            continue;
+
+        mreq.mr_ifindex = config->slaves[i].ifindex;
+        setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                &mreq, sizeof(mreq));
+    }
+
+    return sock;
+}
+
+
+// Open ICMPv6 socket
+static int open_ping_socket(_unused size_t netns)
+{
+    int sock = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+    if (sock < 0)
+        return -1;
+
+    int val = 2;
+    setsockopt(sock, IPPROTO_RAW, IPV6_CHECKSUM, &val, sizeof(val));
+
+    // This is required by RFC 4861
+    val = 255;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+            &val, sizeof(val));
+    setsockopt(sock, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+            &val, sizeof(val));
+
+    // Filter all packages, we only want to send
+    struct icmp6_filter filt;
+    ICMP6_FILTER_SETBLOCKALL(&filt);
+    setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER,
+            &filt, sizeof(filt));
+    return sock;
+}
+
+
+// Open unbound ICMPv6 socket for multicast probes, the interface is
+// chosen by the scope of the solicited-node destination
+static int open_probe_socket(_unused size_t netns)
+{
+    int sock = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+    if (sock < 0)
+        return -1;
+
+    int val = 2;
+    setsockopt(sock, IPPROTO_RAW, IPV6_CHECKSUM, &val, sizeof(val));
+
+    val = 255;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+            &val, sizeof(val));
+
+    val = 0;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+            &val, sizeof(val));
+
+    struct icmp6_filter filt;
+    ICMP6_FILTER_SETBLOCKALL(&filt);
+    setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER,
+            &filt, sizeof(filt));
+    return sock;
+}
+
+
+// Initialize NDP-proxy
+int init_ndp_proxy(const struct relayd_config *relayd_config)
+{
+    config = relayd_config;
+    if (config->slavecount < 1)
+        return 0;
+
+    // Setup netlink sockets, one per namespace
+    if (relayd_open_netns(&rtnl_event, open_rtnl_socket) ||
+            relayd_register_shards(&rtnl_event) ||
+            !(resync_seq = calloc(relayd_netns_count(), sizeof(*resync_seq))))
+        return -1;
 
 
 
@@ -103,8 +302,8 @@ int init_ndp_proxy(const struct relayd_config *relayd_config)
         return 0;
 
     for (size_t i = 0; i < config->static_ndp_len; ++i) {
-        struct ndp_neighbor *n = malloc(sizeof(*n));
-        n->timeout = 0;
+        struct ndp_neighbor *n = calloc(1, sizeof(*n));
+        INIT_LIST_HEAD(&n->keepalive);
 
         char *sep;
         char tbuf[255];
@@ -127,74 +326,63 @@ int init_ndp_proxy(const struct relayd_config *relayd_config)
             return -1;
         }
 
+        n->netns = n->iface->netns;
         list_add(&n->head, &neighbors);
     }
 
-    // Create socket for intercepting NDP
-    int sock = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
-            htons(ETH_P_ALL)); // ETH_P_ALL for ingress + egress
-    if (sock < 0) {
-        syslog(LOG_ERR, "Unable to open packet socket: %s",
-                strerror(errno));
-        return -1;
-    }
-
-    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER,
-            &bpf_prog, sizeof(bpf_prog))) {
-        syslog(LOG_ERR, "Failed to set BPF: %s", strerror(errno));
+    if (relayd_open_netns(&ndp_event_solicit, open_packet_socket) ||
+            relayd_register_shards(&ndp_event_solicit))
         return -1;
-    }
 
+    route_stats_last = relayd_monotonic_ms();
 
-    struct packet_mreq mreq = {config->master.ifindex,
-            PACKET_MR_ALLMULTI, ETH_ALEN, {0}};
-    setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
-            &mreq, sizeof(mreq));
+    // Restored neighbors are revalidated even without keepalives
+    if (config->ndp_keepalive_rate > 0)
+        keepalive_rate = config->ndp_keepalive_rate;
+    else if (config->ndp_snapshot)
+        keepalive_rate = NDP_RESTORE_RATE;
 
-    for (size_t i = 0; i < config->slavecount; ++i) {
-        mreq.mr_ifindex = config->slaves[i].ifindex;
-        setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
-                &mreq, sizeof(mreq));
+    if (keepalive_rate > 0) {
+        keepalive_event.socket = timerfd_create(CLOCK_MONOTONIC,
+                TFD_CLOEXEC | TFD_NONBLOCK);
+        if (keepalive_event.socket < 0) {
+            syslog(LOG_ERR, "Failed to create timer: %s", strerror(errno));
+            return -1;
+        }
+        relayd_register_event(&keepalive_event);
     }
 
-    ndp_event_solicit.socket = sock;
-    relayd_register_event(&ndp_event_solicit);
-
-    // Open ICMPv6 socket
-    ping_socket = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+    if (config->ndp_snapshot) {
+        snapshot_event.socket = timerfd_create(CLOCK_MONOTONIC,
+                TFD_CLOEXEC | TFD_NONBLOCK);
+        if (snapshot_event.socket < 0) {
+            syslog(LOG_ERR, "Failed to create timer: %s", strerror(errno));
+            return -1;
+        }
+        relayd_register_event(&snapshot_event);
 
-    int val = 2;
-    setsockopt(ping_socket, IPPROTO_RAW, IPV6_CHECKSUM, &val, sizeof(val));
+        struct itimerspec its = {{NDP_SNAPSHOT_INTERVAL, 0},
+                {NDP_SNAPSHOT_INTERVAL, 0}};
+        timerfd_settime(snapshot_event.socket, 0, &its, NULL);
+    }
 
-    // This is required by RFC 4861
-    val = 255;
-    setsockopt(ping_socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
-            &val, sizeof(val));
-    setsockopt(ping_socket, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
-            &val, sizeof(val));
+    if (relayd_open_netns(&ping_event, open_ping_socket) ||
+            relayd_open_netns(&probe_event, open_probe_socket))
+        return -1;
 
-    // Filter all packages, we only want to send
-    struct icmp6_filter filt;
-    ICMP6_FILTER_SETBLOCKALL(&filt);
-    setsockopt(ping_socket, IPPROTO_ICMPV6, ICMP6_FILTER,
-            &filt, sizeof(filt));
+    if (config->ndp_snapshot)
+        restore_snapshot(config->ndp_snapshot);
 
 
-    // Netlink socket, continued...
-    group = RTNLGRP_NEIGH;
-    setsockopt(rtnl_event.socket, SOL_NETLINK,
-            NETLINK_ADD_MEMBERSHIP, &group, sizeof(group));
+    // Netlink sockets, continued...
+    for (struct relayd_event *e = &rtnl_event; e; e = e->next_shard) {
+        uint32_t group = RTNLGRP_NEIGH;
+        setsockopt(e->socket, SOL_NETLINK,
+                NETLINK_ADD_MEMBERSHIP, &group, sizeof(group));
 
-    // Synthesize initial neighbor events
-    struct {
-        struct nlmsghdr nh;
-        struct ndmsg ndm;
-    } req = {
-        {sizeof(req), RTM_GETNEIGH, NLM_F_REQUEST | NLM_F_DUMP,
-                ++rtnl_seqid, 0},
-        {.ndm_family = AF_INET6}
-    };
-    send(rtnl_event.socket, &req, sizeof(req), MSG_DONTWAIT);
+        // Synthesize initial neighbor events
+        dump_neighbors(e->socket);
+    }
 
     return 0;
 }
@@ -203,10 +391,31 @@ int init_ndp_proxy(const struct relayd_config *relayd_config)
 // Deinitialize NDP proxy
 void deinit_ndp_proxy()
 {
-    while (!list_empty(&neighbors)) {
-        struct ndp_neighbor *c = list_first_entry(&neighbors,
-                struct ndp_neighbor, head);
-        modify_neighbor(&c->addr, c->iface, false);
+    // With a snapshot learned routes stay in place for the next start
+    bool keep = config && config->ndp_snapshot;
+    if (keep)
+        write_snapshot(config->ndp_snapshot);
+
+    // but aggregates don't, the next start may not meet the threshold
+    struct ndp_aggregate *g, *h;
+    if (keep) {
+        list_for_each_entry_safe(g, h, &aggregates, head) {
+            if (g->iface)
+                uncover_hosts(g, NULL);
+
+            list_del(&g->head);
+            free(g);
+        }
+    }
+
+    struct ndp_neighbor *n, *e;
+    list_for_each_entry_safe(n, e, &neighbors, head) {
+        if (!keep) {
+            free_neighbor(n);
+        } else {
+            list_del(&n->head);
+            free(n);
+        }
     }
 }
 
@@ -221,9 +430,256 @@ static ssize_t ping6(struct in6_addr *addr,
     struct iovec iov = {&echo, sizeof(echo)};
 
     // Linux seems to not honor IPV6_PKTINFO on raw-sockets, so work around
-    setsockopt(ping_socket, SOL_SOCKET, SO_BINDTODEVICE,
+    int sock = relayd_shard_socket(&ping_event, iface->netns);
+    setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE,
             iface->ifname, sizeof(iface->ifname));
-    return relayd_forward_packet(ping_socket, &dest, &iov, 1, iface);
+    return relayd_forward_packet(sock, &dest, &iov, 1, iface);
+}
+
+
+// Masters and their slaves form separate scopes for proxying
+static const struct relayd_interface* ndp_scope(const struct relayd_interface *iface)
+{
+    return (iface->upstream) ? iface->upstream : iface;
+}
+
+
+// Interfaces a target is probed on for a solicitation proxied from except
+static bool is_probed(const struct relayd_interface *iface,
+        const struct relayd_interface *except, bool dad)
+{
+    return iface != except && !(dad && iface->external) &&
+            ndp_scope(iface) == ndp_scope(except) && iface->netns == except->netns;
+}
+
+
+// Solicit a target on all interfaces but one with a single batch of
+// multicast NS, replies are correlated in handle_advert
+static ssize_t probe_neighbor(struct in6_addr *addr,
+        const struct relayd_interface *except, bool dad)
+{
+    struct {
+        struct nd_neighbor_solicit body;
+        struct nd_opt_hdr opt_ll_hdr;
+        uint8_t mac[6];
+    } probe[NDP_PROBE_BATCH];
+    struct sockaddr_in6 dest[NDP_PROBE_BATCH];
+    struct iovec iov[NDP_PROBE_BATCH];
+    struct mmsghdr msg[NDP_PROBE_BATCH];
+
+    // Solicited-node multicast address ff02::1:ffXX:XXXX
+    struct in6_addr snma = {{{0xff, 0x02, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 0x01, 0xff, 0, 0, 0}}};
+    memcpy(&snma.s6_addr[13], &addr->s6_addr[13], 3);
+
+    ssize_t sent = 0;
+    size_t cnt = 0;
+    size_t total = config->mastercount + config->slavecount;
+    for (size_t i = 0; i < total; ++i) {
+        const struct relayd_interface *iface = (i < config->mastercount) ?
+                &config->masters[i] : &config->slaves[i - config->mastercount];
+        if (!is_probed(iface, except, dad))
+            continue;
+
+        probe[cnt] = (typeof(probe[cnt])){
+            .body = {
+                .nd_ns_hdr = {ND_NEIGHBOR_SOLICIT, 0, 0, {{0}}},
+                .nd_ns_target = *addr,
+            },
+            .opt_ll_hdr = {ND_OPT_SOURCE_LINKADDR, 1},
+        };
+        memcpy(probe[cnt].mac, iface->mac, sizeof(probe[cnt].mac));
+
+        dest[cnt] = (struct sockaddr_in6){AF_INET6, 0, 0, snma, iface->ifindex};
+        iov[cnt] = (struct iovec){&probe[cnt], sizeof(probe[cnt])};
+        msg[cnt].msg_hdr = (struct msghdr){.msg_name = &dest[cnt],
+                .msg_namelen = sizeof(dest[cnt]), .msg_iov = &iov[cnt],
+                .msg_iovlen = 1};
+
+        if (++cnt < NDP_PROBE_BATCH && i + 1 < total)
+            continue;
+
+        int res = sendmmsg(relayd_shard_socket(&probe_event, except->netns),
+                msg, cnt, MSG_DONTWAIT);
+        if (res < 0)
+            syslog(LOG_WARNING, "Failed to send NS probe: %s", strerror(errno));
+        else
+            sent += res;
+        cnt = 0;
+    }
+
+    if (cnt > 0) { // Last interface was skipped
+        int res = sendmmsg(relayd_shard_socket(&probe_event, except->netns),
+                msg, cnt, MSG_DONTWAIT);
+        if (res > 0)
+            sent += res;
+    }
+
+    return sent;
+}
+
+
+// Advertise ourselves as the link-layer address of a target
+static ssize_t send_advert(const struct in6_addr *target,
+        const struct in6_addr *dest, const struct relayd_interface *iface,
+        uint32_t flags)
+{
+    struct {
+        struct nd_neighbor_advert body;
+        struct nd_opt_hdr opt_ll_hdr;
+        uint8_t mac[6];
+    } advert = {
+        .body = {
+            .nd_na_hdr = {ND_NEIGHBOR_ADVERT,
+                0, 0, {{0}}},
+            .nd_na_target = *target,
+        },
+        .opt_ll_hdr = {ND_OPT_TARGET_LINKADDR, 1},
+    };
+
+    relayd_get_interface_mac(iface, advert.mac);
+    advert.body.nd_na_flags_reserved = flags;
+
+    struct sockaddr_in6 sdest = {AF_INET6, 0, 0, *dest, 0};
+
+    // Linux seems to not honor IPV6_PKTINFO on raw-sockets, so work around
+    int sock = relayd_shard_socket(&ping_event, iface->netns);
+    setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE,
+                iface->ifname, sizeof(iface->ifname));
+    struct iovec iov = {&advert, sizeof(advert)};
+    return relayd_forward_packet(sock, &sdest, &iov, 1, iface);
+}
+
+
+// Tell the links that solicited a target and the link it was on before
+// that it is now reachable through us, hosts resolving it don't have to
+// wait for a retransmission and hosts with a cached entry switch over
+static void announce_neighbor(struct ndp_neighbor *n,
+        const struct relayd_interface *old)
+{
+    struct in6_addr all_nodes = ALL_IPV6_NODES;
+    for (size_t i = 0; i < n->waiting_cnt; ++i)
+        if (!n->waiting[i]->external && n->waiting[i] != n->iface &&
+                n->waiting[i] != old)
+            send_advert(&n->addr, &all_nodes, n->waiting[i],
+                    ND_NA_FLAG_ROUTER | ND_NA_FLAG_OVERRIDE);
+    n->waiting_cnt = 0;
+
+    if (old && !old->external && old != n->iface)
+        send_advert(&n->addr, &all_nodes, old,
+                ND_NA_FLAG_ROUTER | ND_NA_FLAG_OVERRIDE);
+}
+
+
+// Remember a link soliciting a pending target
+static void add_waiting(struct ndp_neighbor *n, const struct relayd_interface *iface)
+{
+    for (size_t i = 0; i < n->waiting_cnt; ++i)
+        if (n->waiting[i] == iface)
+            return;
+
+    if (n->waiting_cnt < NDP_MAX_WAITING)
+        n->waiting[n->waiting_cnt++] = iface;
+}
+
+
+// Set the kernel neighbor entry of a host to NUD_STALE,
+// the next packet towards it reverifies its link-layer address
+static void stale_neighbor(const struct in6_addr *addr,
+        const struct relayd_interface *iface)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ndmsg ndm;
+        struct rtattr rta_dst;
+        struct in6_addr dst_addr;
+    } req = {
+        {sizeof(req), RTM_NEWNEIGH, NLM_F_REQUEST | NLM_F_REPLACE,
+                __atomic_add_fetch(&rtnl_seqid, 1, __ATOMIC_RELAXED), 0},
+        {.ndm_family = AF_INET6, .ndm_ifindex = iface->ifindex,
+                .ndm_state = NUD_STALE},
+        {sizeof(struct rtattr) + sizeof(struct in6_addr), NDA_DST},
+        *addr,
+    };
+    send(relayd_shard_socket(&rtnl_event, iface->netns), &req, sizeof(req), MSG_DONTWAIT);
+}
+
+
+// Dispatch packets passed by the filter
+static void handle_ndp(void *addr, void *data, size_t len,
+        struct relayd_interface *iface)
+{
+    struct ip6_hdr *ip6 = data;
+    struct icmp6_hdr *icmp6 = (struct icmp6_hdr*)&ip6[1];
+    if (len < sizeof(*ip6) + sizeof(*icmp6))
+        return;
+
+    if (icmp6->icmp6_type == ND_NEIGHBOR_ADVERT)
+        handle_advert(addr, data, len, iface);
+    else
+        handle_solicit(addr, data, len, iface);
+}
+
+
+// Handle answers to probes and learn hosts announcing their addresses
+static void handle_advert(void *addr, void *data, size_t len,
+        struct relayd_interface *iface)
+{
+    struct ip6_hdr *ip6 = data;
+    struct nd_neighbor_advert *adv = (struct nd_neighbor_advert*)&ip6[1];
+    struct sockaddr_ll *ll = addr;
+
+    if (ll->sll_pkttype == PACKET_OUTGOING || len < sizeof(*ip6) + sizeof(*adv))
+        return;
+
+    // Validate as in RFC 4861 7.1.2
+    bool solicited = adv->nd_na_flags_reserved & ND_NA_FLAG_SOLICITED;
+    if (ip6->ip6_hlim != 255 || adv->nd_na_code != 0 ||
+            solicited == IN6_IS_ADDR_MULTICAST(&ip6->ip6_dst) ||
+            IN6_IS_ADDR_MULTICAST(&adv->nd_na_target) ||
+            IN6_IS_ADDR_LINKLOCAL(&adv->nd_na_target) ||
+            IN6_IS_ADDR_LOOPBACK(&adv->nd_na_target) ||
+            IN6_IS_ADDR_UNSPECIFIED(&adv->nd_na_target))
+        return;
+
+    // A target link-layer address must match the sender
+    uint8_t *opt = (uint8_t*)&adv[1], *end = (uint8_t*)data + len;
+    while (opt + 2 <= end && opt[1] > 0 && opt + opt[1] * 8 <= end) {
+        if (opt[0] == ND_OPT_TARGET_LINKADDR && (opt[1] * 8 < 8 ||
+                ll->sll_halen != 6 || memcmp(&opt[2], ll->sll_addr, 6)))
+            return;
+        opt += opt[1] * 8;
+    }
+
+    if (opt != end)
+        return; // Malformed options
+
+    char ipbuf[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &adv->nd_na_target, ipbuf, sizeof(ipbuf));
+
+    if (solicited) {
+        // Only answers to our own probes are of interest: they come from
+        // a link the pending target was probed on and are addressed to
+        // the link-local address the probe was sent from
+        struct ndp_neighbor *n = find_neighbor(iface->netns, &adv->nd_na_target, true);
+        if (!n || n->iface || !n->requester || !is_probed(iface, n->requester, n->dad) ||
+                !IN6_ARE_ADDR_EQUAL(&ip6->ip6_dst, &iface->linklocal))
+            return;
+
+        syslog(LOG_NOTICE, "Got a NA for %s on %s", ipbuf, iface->ifname);
+        modify_neighbor(iface->netns, &adv->nd_na_target, iface, true);
+
+        // Have the kernel track the neighbor from now on
+        ping6(&adv->nd_na_target, iface);
+        return;
+    }
+
+    if (!config->enable_ndp_snooping || !iface->upstream ||
+            iface->external)
+        return;
+
+    syslog(LOG_NOTICE, "Got an unsolicited NA for %s on %s", ipbuf, iface->ifname);
+    snoop_neighbor(&adv->nd_na_target, iface);
 }
 
 
@@ -256,70 +712,64 @@ static void handle_solicit(void *addr, void *data, size_t len,
     syslog(LOG_NOTICE, "Got a NS for %s", ipbuf);
 
     uint8_t mac[6];
-    relayd_get_interface_mac(iface->ifname, mac);
+    relayd_get_interface_mac(iface, mac);
     if (!memcmp(ll->sll_addr, mac, sizeof(mac)) &&
             ll->sll_pkttype != PACKET_OUTGOING)
         return; // Looped back
 
     time_t now = time(NULL);
 
-    struct ndp_neighbor *n = find_neighbor(&req->nd_ns_target, false);
-    if (n && (n->iface || abs(n->timeout - now) < 5)) {
+    struct ndp_neighbor *n = find_neighbor(iface->netns, &req->nd_ns_target, false);
+
+    // Hosts with a DHCPv6 lease are known without probing, a separate
+    // DHCPv6 thread announces them through ndp_learn_lease instead
+    struct relayd_interface *leased;
+    if ((!n || !n->iface) && !config->enable_threads &&
+            (leased = dhcpv6_lookup_lease(iface->netns, &req->nd_ns_target))) {
+        modify_neighbor(iface->netns, &req->nd_ns_target, leased, true);
+        n = find_neighbor(iface->netns, &req->nd_ns_target, true);
+    }
+
+    if (n && (n->iface || labs(n->timeout - now) < 5)) {
         syslog(LOG_NOTICE, "%s is on %s", ipbuf,
                 (n->iface) ? n->iface->ifname : "<pending>");
+        if (!n->iface)
+            add_waiting(n, iface);
+
         if (!n->iface || n->iface == iface)
             return;
 
         // Found on other interface, answer with advertisement
-        struct {
-            struct nd_neighbor_advert body;
-            struct nd_opt_hdr opt_ll_hdr;
-            uint8_t mac[6];
-        } advert = {
-            .body = {
-                .nd_na_hdr = {ND_NEIGHBOR_ADVERT,
-                    0, 0, {{0}}},
-                .nd_na_target = req->nd_ns_target,
-            },
-            .opt_ll_hdr = {ND_OPT_TARGET_LINKADDR, 1},
-        };
-
-        memcpy(advert.mac, mac, sizeof(advert.mac));
-        advert.body.nd_na_flags_reserved = ND_NA_FLAG_ROUTER |
-                ND_NA_FLAG_SOLICITED;
-
-        struct sockaddr_in6 dest = {AF_INET6, 0, 0, ALL_IPV6_NODES, 0};
-        if (!ns_is_dad) // If not DAD, then unicast to source
-            dest.sin6_addr = ip6->ip6_src;
-
-        // Linux seems to not honor IPV6_PKTINFO on raw-sockets, so work around
-        setsockopt(ping_socket, SOL_SOCKET, SO_BINDTODEVICE,
-                    iface->ifname, sizeof(iface->ifname));
-        struct iovec iov = {&advert, sizeof(advert)};
-        relayd_forward_packet(ping_socket, &dest, &iov, 1, iface);
+        struct in6_addr all_nodes = ALL_IPV6_NODES;
+        send_advert(&req->nd_ns_target, (ns_is_dad) ? &all_nodes :
+                &ip6->ip6_src, iface, ND_NA_FLAG_ROUTER | ND_NA_FLAG_SOLICITED);
     } else {
-        // Send echo to all other interfaces to see where target is on
-        // This will trigger neighbor discovery which is what we want.
-        // We will observe the neighbor cache to see results.
-
-        ssize_t sent = 0;
-        if (iface != &config->master)
-            sent += ping6(&req->nd_ns_target, &config->master);
-
-        for (size_t i = 0; i < config->slavecount; ++i)
-            if ((!ns_is_dad || config->slaves[i].external == false)
-                    && iface != &config->slaves[i])
-                sent += ping6(&req->nd_ns_target,
-                        &config->slaves[i]);
-
-        if (sent > 0) // Sent a ping, add pending neighbor entry
-            modify_neighbor(&req->nd_ns_target, NULL, true);
+        // Solicit the target on all other interfaces to see where it is on,
+        // the answering advertisement resolves the pending entry.
+
+        // Address is claimed by a DAD probe, learn it but still probe
+        // other interfaces so that the kernel reveals an actual owner
+        if (ns_is_dad && config->enable_ndp_snooping && !iface->external &&
+                iface->upstream && ip6->ip6_hlim == 255)
+            snoop_neighbor(&req->nd_ns_target, iface);
+
+        ssize_t sent = probe_neighbor(&req->nd_ns_target, iface, ns_is_dad);
+        if (sent > 0) { // Sent a probe, add pending neighbor entry
+            modify_neighbor(iface->netns, &req->nd_ns_target, NULL, true);
+            n = find_neighbor(iface->netns, &req->nd_ns_target, true);
+            if (n && !n->iface) {
+                n->requester = iface;
+                n->dad = ns_is_dad;
+                add_waiting(n, iface);
+            }
+        }
     }
 }
 
 
 void relayd_setup_route(const struct in6_addr *addr, int prefixlen,
-        const struct relayd_interface *iface, const struct in6_addr *gw, bool add)
+        const struct relayd_interface *iface, const struct in6_addr *gw,
+        uint32_t metric, bool add)
 {
     struct req {
         struct nlmsghdr nh;
@@ -330,10 +780,13 @@ void relayd_setup_route(const struct in6_addr *addr, int prefixlen,
         uint32_t ifindex;
         struct rtattr rta_table;
         uint32_t table;
+        struct rtattr rta_prio;
+        uint32_t prio;
         struct rtattr rta_gw;
         struct in6_addr gw;
     } req = {
-        {sizeof(req), 0, NLM_F_REQUEST, ++rtnl_seqid, 0},
+        {sizeof(req), 0, NLM_F_REQUEST,
+                __atomic_add_fetch(&rtnl_seqid, 1, __ATOMIC_RELAXED), 0},
         {AF_INET6, prefixlen, 0, 0, 0, 0, 0, 0, 0},
         {sizeof(struct rtattr) + sizeof(struct in6_addr), RTA_DST},
         *addr,
@@ -341,6 +794,8 @@ void relayd_setup_route(const struct in6_addr *addr, int prefixlen,
         iface->ifindex,
         {sizeof(struct rtattr) + sizeof(uint32_t), RTA_TABLE},
         RT_TABLE_MAIN,
+        {sizeof(struct rtattr) + sizeof(uint32_t), RTA_PRIORITY},
+        metric,
         {sizeof(struct rtattr) + sizeof(struct in6_addr), RTA_GATEWAY},
         IN6ADDR_ANY_INIT,
     };
@@ -359,8 +814,9 @@ void relayd_setup_route(const struct in6_addr *addr, int prefixlen,
         req.rtm.rtm_scope = RT_SCOPE_NOWHERE;
     }
 
-    size_t reqlen = (gw) ? sizeof(req) : offsetof(struct req, rta_gw);
-    send(rtnl_event.socket, &req, reqlen, MSG_DONTWAIT);
+    req.nh.nlmsg_len = (gw) ? sizeof(req) : offsetof(struct req, rta_gw);
+    send(relayd_shard_socket(&rtnl_event, iface->netns), &req,
+            req.nh.nlmsg_len, MSG_DONTWAIT);
 }
 
 // Use rtnetlink to modify kernel routes
@@ -372,16 +828,126 @@ static void setup_route(struct in6_addr *addr, struct relayd_interface *iface,
     syslog(LOG_NOTICE, "%s about %s on %s", (add) ? "Learned" : "Forgot",
             namebuf, (iface) ? iface->ifname : "<pending>");
 
-    if (!iface || !config->enable_route_learning)
+    if (!iface)
         return;
 
-    relayd_setup_route(addr, 128, iface, NULL, add);
+    snapshot_dirty = true;
+    if (config->enable_route_aggregation)
+        aggregate_route(addr, iface, add);
+    else if (config->enable_route_learning)
+        install_route(addr, 128, iface, 0, add);
+}
+
+
+// Install or remove a learned route, accounting the FIB entries we own
+static void install_route(const struct in6_addr *addr, int prefixlen,
+        const struct relayd_interface *iface, uint32_t metric, bool add)
+{
+    relayd_setup_route(addr, prefixlen, iface, NULL, metric, add);
+    ++route_msgs;
+    if (add)
+        ++route_cnt;
+    else if (route_cnt > 0)
+        --route_cnt;
+}
+
+
+// Add or remove the host routes of all learned hosts of an aggregate on
+// its covering interface
+static void route_covered_hosts(struct ndp_aggregate *g,
+        const struct in6_addr *except, bool add)
+{
+    struct ndp_neighbor *n;
+    list_for_each_entry(n, &neighbors, head)
+        if (n->len == 128 && n->iface == g->iface &&
+                !memcmp(&n->addr, &g->prefix, 8) &&
+                (!except || !IN6_ARE_ADDR_EQUAL(&n->addr, except)))
+            install_route(&n->addr, 128, n->iface, 0, add);
+}
+
+
+// Drop the covering route of an aggregate in favor of host routes
+static void uncover_hosts(struct ndp_aggregate *g, const struct in6_addr *except)
+{
+    route_covered_hosts(g, except, true);
+    install_route(&g->prefix, 64, g->iface, NDP_AGGREGATE_METRIC, false);
+    g->iface = NULL;
+    g->covered = 0;
+}
+
+
+// Hosts on the covering interface of a /64 share a single route, hosts
+// elsewhere get exceptions. Traffic towards unknown hosts of the /64
+// follows the covering route and the kernel solicits them there, which
+// we proxy to the other interfaces and learn an exception from.
+static void aggregate_route(const struct in6_addr *addr,
+        struct relayd_interface *iface, bool add)
+{
+    struct ndp_aggregate *g;
+    list_for_each_entry(g, &aggregates, head)
+        if (g->netns == iface->netns && !memcmp(&g->prefix, addr, 8))
+            break;
+
+    if (&g->head == &aggregates) {
+        if (!add || !(g = calloc(1, sizeof(*g))))
+            return;
+
+        memcpy(&g->prefix, addr, 8);
+        g->netns = iface->netns;
+        list_add(&g->head, &aggregates);
+    }
+
+    if (!add) {
+        --g->hosts;
+        if (g->iface != iface)
+            install_route(addr, 128, iface, 0, false);
+        else if (--g->covered < NDP_AGGREGATE_MIN / 2)
+            uncover_hosts(g, addr); // Too few hosts left to be worth it
+
+        if (g->hosts == 0) {
+            list_del(&g->head);
+            free(g);
+        }
+        return;
+    }
+
+    ++g->hosts;
+    if (g->iface == iface) {
+        ++g->covered;
+        return;
+    }
+
+    install_route(addr, 128, iface, 0, true);
+    if (g->iface && g->covered * 2 < g->hosts)
+        uncover_hosts(g, NULL); // Exceptions took over
+
+    if (g->iface || g->hosts < NDP_AGGREGATE_MIN)
+        return;
+
+    // Cover the /64 once most of its known hosts are on one interface
+    struct ndp_neighbor *n;
+    size_t covered = 0;
+    list_for_each_entry(n, &neighbors, head)
+        if (n->len == 128 && n->iface == iface && !memcmp(&n->addr, &g->prefix, 8))
+            ++covered;
+
+    if (covered < NDP_AGGREGATE_MIN || covered * 4 < g->hosts * 3)
+        return;
+
+    g->iface = iface;
+    g->covered = covered;
+    install_route(&g->prefix, 64, iface, NDP_AGGREGATE_METRIC, true);
+    route_covered_hosts(g, NULL, false);
 }
 
 static void free_neighbor(struct ndp_neighbor *n)
 {
     setup_route(&n->addr, n->iface, false);
     list_del(&n->head);
+    if (!list_empty(&n->keepalive)) {
+        list_del(&n->keepalive);
+        --keepalive_cnt;
+    }
     free(n);
     --neighbor_count;
 }
@@ -415,30 +981,31 @@ static bool match_neighbor(struct ndp_neighbor *n, struct in6_addr *addr)
 }
 
 
-static struct ndp_neighbor* find_neighbor(struct in6_addr *addr, bool strict)
+static struct ndp_neighbor* find_neighbor(size_t netns, struct in6_addr *addr,
+        bool strict)
 {
     time_t now = time(NULL);
     struct ndp_neighbor *n, *e;
     list_for_each_entry_safe(n, e, &neighbors, head) {
-        if ((!strict && match_neighbor(n, addr)) ||
-                (n->len == 128 && IN6_ARE_ADDR_EQUAL(&n->addr, addr)))
+        if (n->netns == netns && ((!strict && match_neighbor(n, addr)) ||
+                (n->len == 128 && IN6_ARE_ADDR_EQUAL(&n->addr, addr))))
             return n;
 
-        if (!n->iface && abs(n->timeout - now) >= 5)
+        if (!n->iface && labs(n->timeout - now) >= 5)
             free_neighbor(n);
     }
     return NULL;
 }
 
 
-// Modified our own neighbor-entries
-static void modify_neighbor(struct in6_addr *addr,
+// Modified our own neighbor-entries of a namespace
+static void modify_neighbor(size_t netns, struct in6_addr *addr,
         struct relayd_interface *iface, bool add)
 {
     if (!addr || (void*)addr == (void*)iface)
         return;
 
-    struct ndp_neighbor *n = find_neighbor(addr, true);
+    struct ndp_neighbor *n = find_neighbor(netns, addr, true);
     if (!add) { // Delete action
         if (n && (!n->iface || n->iface == iface))
             free_neighbor(n);
@@ -450,6 +1017,12 @@ static void modify_neighbor(struct in6_addr *addr,
         n->len = 128;
         n->addr = *addr;
         n->iface = iface;
+        n->netns = netns;
+        n->snooped = false;
+        n->requester = NULL;
+        n->dad = false;
+        n->waiting_cnt = 0;
+        INIT_LIST_HEAD(&n->keepalive);
         if (!n->iface)
             time(&n->timeout);
         list_add(&n->head, &neighbors);
@@ -458,15 +1031,281 @@ static void modify_neighbor(struct in6_addr *addr,
     } else if (n->iface == iface) {
         if (!n->iface)
             time(&n->timeout);
+        n->snooped = false;
     } else if (iface && (!n->iface ||
             (!iface->external && n->iface->external))) {
+        bool pending = !n->iface;
         setup_route(addr, n->iface, false);
         n->iface = iface;
+        n->snooped = false;
         setup_route(addr, n->iface, add);
+
+        if (pending && !iface->external)
+            announce_neighbor(n, NULL);
+        n->waiting_cnt = 0;
+    }
+}
+
+
+// A host confirmed reachable on another interface than the one we know
+// has moved. Point the old link at us and reverify the old location,
+// if the host is still there the kernel reports it reachable again.
+// This is the only way a learned host changes between internal links.
+static void move_neighbor(struct in6_addr *addr, struct relayd_interface *iface)
+{
+    struct ndp_neighbor *n = find_neighbor(iface->netns, addr, true);
+    if (!n || !n->iface || n->iface == iface ||
+            iface->external || n->iface->external)
+        return; // Handled by modify_neighbor
+
+    struct relayd_interface *old = n->iface;
+    setup_route(addr, old, false);
+    n->iface = iface;
+    n->snooped = false;
+    setup_route(addr, iface, true);
+
+    announce_neighbor(n, old);
+
+    stale_neighbor(addr, old);
+    ping6(addr, old);
+}
+
+
+// Queue a single ping for a learned neighbor the kernel reported
+// NUD_STALE, or for one restored from a snapshot to be revalidated
+static void queue_keepalive(struct ndp_neighbor *n, bool revalidate)
+{
+    if (!keepalive_rate || !list_empty(&n->keepalive) ||
+            (!revalidate && config->ndp_keepalive_rate <= 0))
+        return;
+
+    uint64_t now = relayd_monotonic_ms();
+    n->keepalive_due = now;
+    list_add_tail(&n->keepalive, &keepalives);
+
+    if (keepalive_cnt++ == 0) {
+        struct itimerspec its = {{0, 0}, {0, 1000000}};
+        timerfd_settime(keepalive_event.socket, 0, &its, NULL);
+        keepalive_last = now;
+    }
+}
+
+
+// Ping due neighbors within the configured budget per second, the
+// kernel then reconfirms a stale entry or drops a host that is gone
+static void handle_keepalive(struct relayd_event *event)
+{
+    uint64_t cnt;
+    if (read(event->socket, &cnt, sizeof(cnt)) != sizeof(cnt))
+        return;
+
+    // Credit is counted in thousandths of a probe
+    uint64_t rate = keepalive_rate;
+    uint64_t now = relayd_monotonic_ms();
+    keepalive_credit += (now - keepalive_last) * rate;
+    if (keepalive_credit > rate * 1000)
+        keepalive_credit = rate * 1000; // At most one second of burst
+    keepalive_last = now;
+
+    struct ndp_neighbor *n = NULL;
+    while (!list_empty(&keepalives)) {
+        n = list_first_entry(&keepalives, struct ndp_neighbor, keepalive);
+        if (n->keepalive_due > now || keepalive_credit < 1000)
+            break;
+
+        if (now - n->keepalive_due > NDP_KEEPALIVE_LATE_MS)
+            ++keepalive_late; // Budget too low for the churn of entries
+
+        ping6(&n->addr, n->iface);
+        ++keepalive_sent;
+        keepalive_credit -= 1000;
+
+        // The next NUD_STALE notification queues it again
+        list_del_init(&n->keepalive);
+        --keepalive_cnt;
+        n = NULL;
+    }
+
+    // Sleep until the next neighbor is due or there is credit for it
+    uint64_t wait = 0;
+    if (n && n->keepalive_due > now)
+        wait = n->keepalive_due - now;
+    else if (n)
+        wait = (1000 - keepalive_credit + rate - 1) / rate;
+
+    struct itimerspec its = {{0, 0}, {wait / 1000, (wait % 1000) * 1000000}};
+    if (n && wait == 0)
+        its.it_value.tv_nsec = 1000000;
+    timerfd_settime(event->socket, 0, &its, NULL);
+}
+
+// Remove the host route a previous run left for a neighbor we don't restore
+static void forget_snapshot_route(const char *name, const struct in6_addr *addr,
+        const struct relayd_interface *iface)
+{
+    struct relayd_interface gone = {.ifindex = 0};
+    if (!iface && !strchr(name, '/')) { // Interface is no longer configured
+        gone.ifindex = if_nametoindex(name);
+        iface = &gone;
+    }
+
+    if (iface && iface->ifindex > 0)
+        relayd_setup_route(addr, 128, iface, NULL, 0, false);
+}
+
+
+// Restore learned neighbors, they are trusted until the kernel says
+// otherwise and revalidated in the background
+static void restore_snapshot(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return; // No snapshot yet
+
+    char name[PATH_MAX], ipbuf[INET6_ADDRSTRLEN];
+    size_t restored = 0;
+    while (fscanf(fp, "%255s %45s", name, ipbuf) == 2) {
+        struct relayd_interface *iface = relayd_get_interface_by_name(name);
+        struct in6_addr addr;
+        if (inet_pton(AF_INET6, ipbuf, &addr) != 1)
+            continue; // Invalid entry
+
+        struct ndp_neighbor *n = (iface) ?
+                find_neighbor(iface->netns, &addr, true) : NULL;
+        if (!iface || n) { // Interface went away or duplicate entry
+            if (!n || n->iface != iface)
+                forget_snapshot_route(name, &addr, iface);
+            continue;
+        }
+
+        modify_neighbor(iface->netns, &addr, iface, true);
+        n = find_neighbor(iface->netns, &addr, true);
+        if (n && n->iface == iface) {
+            n->snooped = true;
+            queue_keepalive(n, true);
+            ++restored;
+        } else {
+            forget_snapshot_route(name, &addr, iface);
+        }
+    }
+
+    fclose(fp);
+    snapshot_dirty = false;
+    syslog(LOG_NOTICE, "Restored %zu neighbors from %s", restored, path);
+}
+
+
+static void write_snapshot(const char *path)
+{
+    char tmpfile[PATH_MAX];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", path);
+
+    FILE *fp = fopen(tmpfile, "w");
+    if (!fp) {
+        syslog(LOG_WARNING, "Unable to write neighbor snapshot %s (%s)",
+                path, strerror(errno));
+        return;
     }
-    // TODO: In case a host switches interfaces we might want
-    // to set its old neighbor entry to NUD_STALE and ping it
-    // on the old interface to confirm if the MACs match.
+
+    struct ndp_neighbor *n;
+    list_for_each_entry(n, &neighbors, head) {
+        if (!n->iface || n->len != 128)
+            continue;
+
+        char ipbuf[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &n->addr, ipbuf, sizeof(ipbuf));
+        fprintf(fp, "%s %s\n", n->iface->name, ipbuf);
+    }
+
+    if (fclose(fp) || rename(tmpfile, path))
+        unlink(tmpfile);
+    else
+        snapshot_dirty = false;
+}
+
+
+static void handle_snapshot(struct relayd_event *event)
+{
+    uint64_t cnt;
+    if (read(event->socket, &cnt, sizeof(cnt)) == sizeof(cnt) && snapshot_dirty)
+        write_snapshot(config->ndp_snapshot);
+}
+
+void dump_ndp_stats(FILE *fp)
+{
+    if (!config || !config->enable_ndp_relay)
+        return;
+
+    fprintf(fp, "ndp_neighbors count %zu limit %u\n",
+            neighbor_count, NDP_MAX_NEIGHBORS);
+    fprintf(fp, "ndp_keepalive rate %i queued %zu sent %u late %u\n",
+            config->ndp_keepalive_rate, keepalive_cnt, keepalive_sent,
+            keepalive_late);
+
+    // Netlink rate since the last dump
+    uint64_t now = relayd_monotonic_ms();
+    uint32_t rate = (now > route_stats_last) ? (route_msgs - route_msgs_last) *
+            1000ULL / (now - route_stats_last) : 0;
+    route_msgs_last = route_msgs;
+    route_stats_last = now;
+
+    size_t aggregated = 0;
+    struct ndp_aggregate *g;
+    list_for_each_entry(g, &aggregates, head)
+        if (g->iface)
+            ++aggregated;
+
+    fprintf(fp, "ndp_routes fib %zu aggregates %zu messages %u rate %u\n",
+            route_cnt, aggregated, route_msgs, rate);
+}
+
+
+// Learn a host from its own announcement. A host known on another
+// interface is only moved once the kernel confirms it reachable here,
+// so we ask it to check rather than trusting the announcement.
+static void snoop_neighbor(struct in6_addr *addr, struct relayd_interface *iface)
+{
+    struct ndp_neighbor *n = find_neighbor(iface->netns, addr, true);
+    if (n && n->iface && (n->iface != iface || !n->snooped)) {
+        if (n->snooped)
+            ping6(addr, iface);
+        return;
+    }
+
+    modify_neighbor(iface->netns, addr, iface, true);
+    if ((n = find_neighbor(iface->netns, addr, true)) && n->iface == iface)
+        n->snooped = true;
+}
+
+
+// Learn or forget a host from a DHCPv6 lease committed or released on iface
+static void learn_lease(struct relayd_message *msg)
+{
+    // The lease confirms a host we only snooped elsewhere
+    struct ndp_neighbor *n = find_neighbor(msg->iface->netns, &msg->addr, true);
+    if (msg->add && n && n->snooped && n->iface != msg->iface)
+        move_neighbor(&msg->addr, msg->iface);
+
+    modify_neighbor(msg->iface->netns, &msg->addr, msg->iface, msg->add);
+}
+
+
+void ndp_learn_lease(const struct in6_addr *addr,
+        struct relayd_interface *iface, bool add)
+{
+    if (!config || !config->enable_ndp_relay)
+        return;
+
+    struct relayd_message msg = {.handle = learn_lease,
+            .iface = iface, .addr = *addr, .add = add};
+    relayd_post(RELAYD_LOOP_NDP, &msg);
+}
+
+
+// Runs on the DHCPv6 loop which owns the reconfiguration state
+static void reconf_prefixes(struct relayd_message *msg)
+{
+    msg->iface->pd_reconf = true;
 }
 
 
@@ -484,6 +1323,15 @@ static void handle_rtnetlink(_unused void *addr, void *data, size_t len,
                 rtm->rtm_dst_len == 0)
             raise(SIGUSR1); // Inform about a change in default route
 
+        // Neighbors of a resync are in, addresses are next
+        size_t netns = relayd_receive_netns();
+        if (nh->nlmsg_type == NLMSG_DONE && resync_seq &&
+                resync_seq[netns] && nh->nlmsg_seq == resync_seq[netns]) {
+            resync_seq[netns] = 0;
+            dump_addresses(relayd_shard_socket(&rtnl_event, netns));
+            continue;
+        }
+
         struct ndmsg *ndm = NLMSG_DATA(nh);
         struct ifaddrmsg *ifa = NLMSG_DATA(nh);
         if (nh->nlmsg_type != RTM_NEWNEIGH
@@ -501,7 +1349,8 @@ static void handle_rtnetlink(_unused void *addr, void *data, size_t len,
 
         // Lookup interface
         struct relayd_interface *iface;
-        if (!(iface = relayd_get_interface_by_index(ndm->ndm_ifindex)))
+        if (!(iface = relayd_get_interface_by_index(relayd_receive_netns(),
+                ndm->ndm_ifindex)))
             continue;
 
         // Data to retrieve
@@ -516,6 +1365,14 @@ static void handle_rtnetlink(_unused void *addr, void *data, size_t len,
                     RTA_PAYLOAD(rta) >= sizeof(*addr))
                 addr = RTA_DATA(rta);
 
+        // Remember where answers to our NS probes are sent to
+        if (is_addr && addr && IN6_IS_ADDR_LINKLOCAL(addr)) {
+            if (nh->nlmsg_type == RTM_NEWADDR)
+                iface->linklocal = *addr;
+            else if (IN6_ARE_ADDR_EQUAL(&iface->linklocal, addr))
+                iface->linklocal = (struct in6_addr)IN6ADDR_ANY_INIT;
+        }
+
         // Address not specified or unrelated
         if (!addr || IN6_IS_ADDR_LINKLOCAL(addr) ||
                 IN6_IS_ADDR_MULTICAST(addr))
@@ -530,16 +1387,29 @@ static void handle_rtnetlink(_unused void *addr, void *data, size_t len,
                 (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE
                         | NUD_PERMANENT | NUD_NOARP)));
 
+        if (config->enable_ndp_relay && !is_addr && add &&
+                (ndm->ndm_state & NUD_REACHABLE))
+            move_neighbor(addr, iface);
+
         if (config->enable_ndp_relay)
-            modify_neighbor(addr, iface, add);
+            modify_neighbor(iface->netns, addr, iface, add);
+
+        // Refresh learned neighbors going stale so that their routes stay
+        struct ndp_neighbor *n;
+        if (config->enable_ndp_relay && !is_addr && add &&
+                (ndm->ndm_state & NUD_STALE) &&
+                (n = find_neighbor(iface->netns, addr, true)) && n->iface == iface)
+            queue_keepalive(n, false);
 
         if (is_addr && config->enable_router_discovery_server)
             raise(SIGUSR1); // Inform about a change in addresses
 
-        if (is_addr && config->enable_dhcpv6_server)
-            iface->pd_reconf = true;
+        if (is_addr && config->enable_dhcpv6_server) {
+            struct relayd_message msg = {.handle = reconf_prefixes, .iface = iface};
+            relayd_post(RELAYD_LOOP_DHCPV6, &msg);
+        }
 
-        if (config->enable_ndp_relay && is_addr && iface == &config->master) {
+        if (config->enable_ndp_relay && is_addr && !iface->upstream) {
             // Replay address changes on all slave interfaces
             nh->nlmsg_flags = NLM_F_REQUEST;
 
@@ -547,15 +1417,14 @@ static void handle_rtnetlink(_unused void *addr, void *data, size_t len,
                 nh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
 
             for (size_t i = 0; i < config->slavecount; ++i) {
+                if (config->slaves[i].upstream != iface)
+                    continue;
+
                 ifa->ifa_index = config->slaves[i].ifindex;
-                send(rtnl_event.socket, nh, nh->nlmsg_len, MSG_DONTWAIT);
+                send(relayd_shard_socket(&rtnl_event, iface->netns),
+                        nh, nh->nlmsg_len, MSG_DONTWAIT);
             }
         }
 
-        /* TODO: See if this is required for optimal operation
-        // Keep neighbor entries alive so we don't loose routes
-        if (add && (ndm->ndm_state & NUD_STALE))
-            ping6(addr, iface);
-        */
     }
 }
@@ -22,11 +22,36 @@
 #endif
 
 #define NDP_MAX_NEIGHBORS 1000
+#define NDP_PROBE_BATCH 16
+#define NDP_MAX_WAITING 4 // Links told about a pending target once resolved
+#define NDP_KEEPALIVE_LATE_MS 5000 // Stale entries still waiting for a ping
+#define NDP_RESTORE_RATE 100 // Revalidations/s without keepalives
+#define NDP_SNAPSHOT_INTERVAL 60
+#define NDP_AGGREGATE_MIN 16 // Hosts on one interface, also 3/4 of the /64
+#define NDP_AGGREGATE_METRIC 128 // Preferred over on-link prefix routes
 
 struct ndp_neighbor {
     struct list_head head;
     struct relayd_interface *iface;
+    size_t netns; // Neighbors of other namespaces never match
     struct in6_addr addr;
     uint8_t len;
+    bool snooped; // From NA, DAD or a snapshot, not confirmed by the kernel
+    const struct relayd_interface *requester; // Pending: NS was proxied from
+    bool dad; // Pending: probed for a DAD solicitation
+    const struct relayd_interface *waiting[NDP_MAX_WAITING]; // Pending: solicited from
+    uint8_t waiting_cnt;
+    struct list_head keepalive;
+    uint64_t keepalive_due;
     time_t timeout;
 };
+
+// Learned hosts of a /64, covered by one route where possible
+struct ndp_aggregate {
+    struct list_head head;
+    struct in6_addr prefix;
+    size_t netns;
+    struct relayd_interface *iface; // Covering route or NULL
+    size_t hosts;
+    size_t covered;
+};
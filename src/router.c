@@ -29,18 +29,20 @@
 
 
 static void forward_router_solicitation(const struct relayd_interface *iface);
-static void forward_router_advertisement(uint8_t *data, size_t len);
-static int open_icmpv6_socket(struct icmp6_filter *filt,
-        struct ipv6_mreq *slave_mreq);
+static void forward_router_advertisement(const struct relayd_interface *master,
+        uint8_t *data, size_t len);
+static int open_icmpv6_socket(size_t first, size_t count);
 
 static void handle_icmpv6(void *addr, void *data, size_t len,
         struct relayd_interface *iface);
 static void send_router_advert(struct relayd_event *event);
 static void sigusr1_refresh(int signal);
 
-static struct relayd_event router_discovery_event = {-1, NULL, handle_icmpv6};
+static struct relayd_event router_discovery_event = {.socket = -1,
+        .handle_dgram = handle_icmpv6, .exclusive = true,
+        .priority = RELAYD_PRIO_HIGH};
 
-static FILE *fp_route = NULL;
+static FILE **fp_route = NULL; // Per namespace
 static const struct relayd_config *config = NULL;
 static bool in_shutdown = false;
 
@@ -50,26 +52,24 @@ int init_router_discovery_relay(const struct relayd_config *relayd_config)
 {
     config = relayd_config;
 
-    // Filter ICMPv6 package types
-    struct icmp6_filter filt;
-    ICMP6_FILTER_SETBLOCKALL(&filt);
-    ICMP6_FILTER_SETPASS(ND_ROUTER_ADVERT, &filt);
-    ICMP6_FILTER_SETPASS(ND_ROUTER_SOLICIT, &filt);
-
-    // Open ICMPv6 socket
-    struct ipv6_mreq slaves = {ALL_IPV6_ROUTERS, config->master.ifindex};
-    router_discovery_event.socket = open_icmpv6_socket(&filt, &slaves);
-
-    if (router_discovery_event.socket < 0) {
+    // Open ICMPv6 sockets
+    if (relayd_open_shards(&router_discovery_event, open_icmpv6_socket)) {
         syslog(LOG_ERR, "Failed to open RAW-socket: %s",
                 strerror(errno));
         return -1;
     }
 
-    if (!(fp_route = fopen("/proc/net/ipv6_route", "r"))) {
-        syslog(LOG_ERR, "Failed to open routing table: %s",
-                strerror(errno));
+    // The routing table shown is the one of the namespace opening it
+    if (!(fp_route = calloc(relayd_netns_count(), sizeof(*fp_route))))
         return -1;
+
+    for (size_t i = 0; i < relayd_netns_count(); ++i) {
+        if (relayd_enter_netns(i) ||
+                !(fp_route[i] = fopen("/proc/net/ipv6_route", "r"))) {
+            syslog(LOG_ERR, "Failed to open routing table: %s",
+                    strerror(errno));
+            return -1;
+        }
     }
 
     if (config->enable_router_discovery_server) {
@@ -90,26 +90,34 @@ int init_router_discovery_relay(const struct relayd_config *relayd_config)
 
         // Disable looping for RA-events
         int zero = 0;
-        setsockopt(router_discovery_event.socket, IPPROTO_IPV6,
-                IPV6_MULTICAST_LOOP, &zero, sizeof(zero));
+        for (struct relayd_event *e = &router_discovery_event; e; e = e->next_shard)
+            setsockopt(e->socket, IPPROTO_IPV6,
+                    IPV6_MULTICAST_LOOP, &zero, sizeof(zero));
 
         // Get informed when addresses change
         struct sigaction sa = {.sa_handler = sigusr1_refresh};
         sigaction(SIGUSR1, &sa, NULL);
     } else if (config->enable_router_discovery_relay) {
-        struct ipv6_mreq an = {ALL_IPV6_NODES, config->master.ifindex};
-        setsockopt(router_discovery_event.socket, IPPROTO_IPV6,
-                IPV6_ADD_MEMBERSHIP, &an, sizeof(an));
+        for (size_t i = 0; i < config->mastercount; ++i) {
+            struct ipv6_mreq an = {ALL_IPV6_NODES, config->masters[i].ifindex};
+            setsockopt(relayd_shard_socket(&router_discovery_event,
+                    config->masters[i].netns), IPPROTO_IPV6,
+                    IPV6_ADD_MEMBERSHIP, &an, sizeof(an));
+        }
     }
 
     if (config->send_router_solicitation)
-        forward_router_solicitation(&config->master);
+        for (size_t i = 0; i < config->mastercount; ++i)
+            forward_router_solicitation(&config->masters[i]);
 
     if (config->slavecount > 0 && (config->enable_router_discovery_relay ||
-            config->enable_router_discovery_server))
-        relayd_register_event(&router_discovery_event);
-    else
-        close(router_discovery_event.socket);
+            config->enable_router_discovery_server)) {
+        if (relayd_register_shards(&router_discovery_event))
+            return -1;
+    } else {
+        for (struct relayd_event *e = &router_discovery_event; e; e = e->next_shard)
+            close(e->socket);
+    }
 
     return 0;
 }
@@ -135,9 +143,8 @@ static void sigusr1_refresh(_unused int signal)
 }
 
 
-// Create an ICMPv6 socket and setup basic attributes
-static int open_icmpv6_socket(struct icmp6_filter *filt,
-        struct ipv6_mreq *slave_mreq)
+// Create an ICMPv6 socket for a range of slaves and setup basic attributes
+static int open_icmpv6_socket(size_t first, size_t count)
 {
     int sock = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
     if (sock < 0)
@@ -160,13 +167,18 @@ static int open_icmpv6_socket(struct icmp6_filter *filt,
     setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &val, sizeof(val));
 
     // Filter ICMPv6 package types
-    setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, filt, sizeof(*filt));
+    struct icmp6_filter filt;
+    ICMP6_FILTER_SETBLOCKALL(&filt);
+    ICMP6_FILTER_SETPASS(ND_ROUTER_ADVERT, &filt);
+    ICMP6_FILTER_SETPASS(ND_ROUTER_SOLICIT, &filt);
+    setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filt, sizeof(filt));
 
     // Configure multicast addresses
-    for (size_t i = 0; i < config->slavecount; ++i) {
-        slave_mreq->ipv6mr_interface = config->slaves[i].ifindex;
+    struct ipv6_mreq mreq = {ALL_IPV6_ROUTERS, 0};
+    for (size_t i = first; i < first + count; ++i) {
+        mreq.ipv6mr_interface = config->slaves[i].ifindex;
         setsockopt(sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP,
-                slave_mreq, sizeof(*slave_mreq));
+                &mreq, sizeof(mreq));
     }
 
     return sock;
@@ -179,16 +191,13 @@ static void handle_icmpv6(_unused void *addr, void *data, size_t len,
 {
     struct icmp6_hdr *hdr = data;
     if (config->enable_router_discovery_server) { // Server mode
-        if (hdr->icmp6_type == ND_ROUTER_SOLICIT &&
-                iface != &config->master)
+        if (hdr->icmp6_type == ND_ROUTER_SOLICIT && iface->upstream)
             send_router_advert(&iface->timer_rs);
     } else { // Relay mode
-        if (hdr->icmp6_type == ND_ROUTER_ADVERT
-                && iface == &config->master)
-            forward_router_advertisement(data, len);
-        else if (hdr->icmp6_type == ND_ROUTER_SOLICIT
-                && iface != &config->master)
-            forward_router_solicitation(&config->master);
+        if (hdr->icmp6_type == ND_ROUTER_ADVERT && !iface->upstream)
+            forward_router_advertisement(iface, data, len);
+        else if (hdr->icmp6_type == ND_ROUTER_SOLICIT && iface->upstream)
+            forward_router_solicitation(iface->upstream);
     }
 }
 
@@ -208,14 +217,15 @@ static bool match_route(const struct relayd_ipaddr *n, const struct in6_addr *ad
 
 
 // Detect whether a default route exists, also find the source prefixes
-static bool parse_routes(struct relayd_ipaddr *n, ssize_t len)
+static bool parse_routes(size_t netns, struct relayd_ipaddr *n, ssize_t len)
 {
-    rewind(fp_route);
+    FILE *fp = fp_route[netns];
+    rewind(fp);
 
     char line[512], ifname[16];
     bool found_default = false;
     struct relayd_ipaddr p = {IN6ADDR_ANY_INIT, 0, 0, 0};
-    while (fgets(line, sizeof(line), fp_route)) {
+    while (fgets(line, sizeof(line), fp)) {
         uint32_t rflags;
         if (sscanf(line, "00000000000000000000000000000000 00 "
                 "%*s %*s %*s %*s %*s %*s %*s %15s", ifname) &&
@@ -255,7 +265,7 @@ static void send_router_advert(struct relayd_event *event)
     struct relayd_interface *iface =
             container_of(event, struct relayd_interface, timer_rs);
 
-    int mtu = relayd_get_interface_mtu(iface->ifname);
+    int mtu = relayd_get_interface_mtu(iface);
     if (mtu < 0)
         mtu = 1500;
 
@@ -280,17 +290,17 @@ static void send_router_advert(struct relayd_event *event)
         adv.h.nd_ra_flags_reserved |= ND_RA_PREF_LOW;
     else if (config->ra_preference > 0)
         adv.h.nd_ra_flags_reserved |= ND_RA_PREF_HIGH;
-    relayd_get_interface_mac(iface->ifname, adv.lladdr.data);
+    relayd_get_interface_mac(iface, adv.lladdr.data);
 
     // If not currently shutting down
     struct relayd_ipaddr addrs[RELAYD_MAX_PREFIXES];
     ssize_t ipcnt = 0;
 
     if (!in_shutdown) {
-        ipcnt = relayd_get_interface_addresses(iface->ifindex,
+        ipcnt = relayd_get_interface_addresses(iface,
                 addrs, ARRAY_SIZE(addrs));
 
-        if (parse_routes(addrs, ipcnt)) // Have default route
+        if (parse_routes(iface->netns, addrs, ipcnt)) // Have default route
             adv.h.nd_ra_router_lifetime =
                     htons(3 * MaxRtrAdvInterval);
     }
@@ -444,7 +454,7 @@ static void send_router_advert(struct relayd_event *event)
             {&routes, routes_cnt * sizeof(*routes)},
             {&dns, dnslen}, {&domain, domain_len}};
     struct sockaddr_in6 all_nodes = {AF_INET6, 0, 0, ALL_IPV6_NODES, 0};
-    relayd_forward_packet(router_discovery_event.socket,
+    relayd_forward_packet(relayd_shard_socket(&router_discovery_event, iface->netns),
             &all_nodes, iov, 4, iface);
 
     // Rearm timer
@@ -465,13 +475,14 @@ static void forward_router_solicitation(const struct relayd_interface *iface)
         {AF_INET6, 0, 0, ALL_IPV6_ROUTERS, iface->ifindex};
 
     syslog(LOG_NOTICE, "Sending RS to %s", iface->ifname);
-    relayd_forward_packet(router_discovery_event.socket,
+    relayd_forward_packet(relayd_shard_socket(&router_discovery_event, iface->netns),
             &all_routers, &iov, 1, iface);
 }
 
 
-// Handler for incoming router solicitations on slave interfaces
-static void forward_router_advertisement(uint8_t *data, size_t len)
+// Handler for incoming router advertisements on master interfaces
+static void forward_router_advertisement(const struct relayd_interface *master,
+        uint8_t *data, size_t len)
 {
     struct nd_router_advert *adv = (struct nd_router_advert *)data;
 
@@ -501,10 +512,13 @@ static void forward_router_advertisement(uint8_t *data, size_t len)
     // Indicate a proxy, however we don't follow the rest of RFC 4389 yet
     adv->nd_ra_flags_reserved |= ND_RA_FLAG_PROXY;
 
-    // Forward advertisement to all slave interfaces
+    // Forward advertisement to all slave interfaces of the master
     struct sockaddr_in6 all_nodes = {AF_INET6, 0, 0, ALL_IPV6_NODES, 0};
     struct iovec iov = {data, len};
     for (size_t i = 0; i < config->slavecount; ++i) {
+        if (config->slaves[i].upstream != master)
+            continue;
+
         // Fixup source hardware address option
         if (mac_ptr)
             memcpy(mac_ptr, config->slaves[i].mac, 6);
@@ -518,7 +532,7 @@ static void forward_router_advertisement(uint8_t *data, size_t len)
                 rewrite = &config->dnsaddr;
             } else {
                 if (relayd_get_interface_addresses(
-                    config->slaves[i].ifindex,
+                    &config->slaves[i],
                     &addr, 1) < 1)
                 continue; // Unable to comply
                 rewrite = &addr.addr;
@@ -529,7 +543,7 @@ static void forward_router_advertisement(uint8_t *data, size_t len)
                 dns_ptr[i] = *rewrite;
         }
 
-        relayd_forward_packet(router_discovery_event.socket,
-            &all_nodes, &iov, 1, &config->slaves[i]);
+        relayd_forward_packet(relayd_shard_socket(&router_discovery_event,
+            config->slaves[i].netns), &all_nodes, &iov, 1, &config->slaves[i]);
     }
 }